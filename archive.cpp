@@ -0,0 +1,233 @@
+/* File: archive.cpp
+ * Program: two-pass linker
+ * Module archives: library modules with a prebuilt symbol index, of
+ * which a link takes only the modules its E instructions need
+ */
+#include "linker.h"
+#include <algorithm>
+#include <deque>
+
+const char arcMagic[8] = {'\177', 'L', 'K', 'A', 'R', 'C', '1', '\n'};
+
+static bool entryLess(const ArcIndexEntry& a, const ArcIndexEntry& b){
+    return memcmp(a.name, b.name, sizeof(a.name)) < 0;
+}
+
+/* Symbols that the E instructions of module i refer to, in order and
+ * with repeats; uselist entries no instruction refers to are left out
+ */
+void referencedSymbols(const ModuleIR& ir, int i, vector<int>& refs){
+    refs.clear();
+    int useFirst = ir.useBase[i];
+    int useCount = ir.useBase[i+1] - useFirst;
+    for (int j = ir.moduleBase[i]; j < ir.moduleBase[i+1]; j++) {
+        if (ir.type[j] == TYPE_E && ir.operand[j] < useCount){
+            refs.push_back(ir.useSym[useFirst + ir.operand[j]]);
+        }
+    }
+}
+
+/* Parse a text input and write its modules to an archive */
+bool Linker::makeArchive(const char* inputPath, const char* archivePath){
+    if (!parseOnly(inputPath)){
+        return false;
+    }
+    int modules = program.moduleCount();
+    vector<ArcIndexEntry> index;
+    vector<bool> indexed(symbolTable.entries.size(), false);
+    for (int i = 0; i < modules; i++) {
+        for (int k = program.defBase[i]; k < program.defBase[i+1]; k++) {
+            int sym = program.defSym[k];
+            if (indexed[sym]){
+                continue;
+            }
+            ArcIndexEntry entry;
+            memcpy(entry.name, symbolTable.entries[sym].key.w, sizeof(entry.name));
+            entry.length = symbolTable.entries[sym].length;
+            entry.module = i;
+            index.push_back(entry);
+            indexed[sym] = true;
+        }
+    }
+    sort(index.begin(), index.end(), entryLess);
+
+    vector<unsigned long long> offset(1, 0);
+    string records;
+    string record;
+    for (int i = 0; i < modules; i++) {
+        moduleRecord(i, record);
+        records += record;
+        offset.push_back(records.size());
+    }
+    ArcHeader header;
+    memcpy(header.magic, arcMagic, sizeof(arcMagic));
+    header.maxDefs = config.maxDefs;
+    header.maxUses = config.maxUses;
+    header.wordWidth = config.wordWidth;
+    header.moduleCount = modules;
+    header.indexCount = index.size();
+    header.reserved = 0;
+    string image((const char*)&header, sizeof(header));
+    if (!index.empty()){
+        image.append((const char*)&index[0], index.size() * sizeof(ArcIndexEntry));
+    }
+    image.append((const char*)&offset[0], offset.size() * sizeof(offset[0]));
+    image += records;
+    return writeFile(archivePath, image);
+}
+
+Archive::~Archive(){
+    if (data != NULL){
+        munmap(data, size);
+    }
+}
+
+/* Map an archive and check its layout
+ * Return NULL, or what is wrong with it
+ */
+const char* Archive::open(const char* path, const MachineConfig& config){
+    int fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0){
+        if (fd >= 0){
+            close(fd);
+        }
+        return "Fail to open archive ";
+    }
+    size = st.st_size;
+    if (size < sizeof(header)){
+        close(fd);
+        size = 0;
+        return "Invalid archive ";
+    }
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED){
+        size = 0;
+        return "Fail to open archive ";
+    }
+    data = (char*)mapped;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, arcMagic, sizeof(arcMagic)) != 0
+        || header.moduleCount < 0 || header.indexCount < 0){
+        return "Invalid archive ";
+    }
+    if (header.maxDefs != config.maxDefs || header.maxUses != config.maxUses
+        || header.wordWidth != config.wordWidth){
+        return "Archive made for another machine configuration: ";
+    }
+    size_t tables = sizeof(header) + (size_t)header.indexCount * sizeof(ArcIndexEntry)
+                    + ((size_t)header.moduleCount + 1) * sizeof(unsigned long long);
+    if (tables > size){
+        return "Invalid archive ";
+    }
+    index = (const ArcIndexEntry*)(data + sizeof(header));
+    offset = (const unsigned long long*)(index + header.indexCount);
+    records = data + tables;
+    for (int k = 0; k < header.indexCount; k++) {
+        if (index[k].length <= 0 || index[k].length > 16
+            || index[k].module < 0 || index[k].module >= header.moduleCount
+            || (k > 0 && !entryLess(index[k-1], index[k]))){
+            return "Invalid archive ";
+        }
+    }
+    for (int m = 0; m < header.moduleCount; m++) {
+        if (offset[m] > offset[m+1]){
+            return "Invalid archive ";
+        }
+    }
+    if (offset[0] != 0 || offset[header.moduleCount] != size - tables){
+        return "Invalid archive ";
+    }
+    return NULL;
+}
+
+/* Return the module defining a symbol, -1 if the archive has none */
+int Archive::find(const char* name, int length) const{
+    ArcIndexEntry key;
+    memset(key.name, 0, sizeof(key.name));
+    memcpy(key.name, name, length);
+    const ArcIndexEntry* last = index + header.indexCount;
+    const ArcIndexEntry* it = lower_bound(index, last, key, entryLess);
+    if (it == last || memcmp(it->name, key.name, sizeof(key.name)) != 0){
+        return -1;
+    }
+    return it->module;
+}
+
+CacheRecord Archive::member(int module) const{
+    CacheRecord record;
+    record.data = records + offset[module];
+    record.size = offset[module+1] - offset[module];
+    record.kept = false;
+    return record;
+}
+
+/* Add the archive modules the program needs
+ * Every module of the input is linked. A symbol an E instruction of a
+ * linked module refers to, and that no linked module defines, is looked
+ * up in the archives in command line order and the module defining it
+ * is appended, so its own references are resolved in turn. Symbols no
+ * archive defines are left for pass two to report as not defined.
+ */
+bool Linker::linkArchives(){
+    deque<Archive> libs(archives.size());
+    for (int k = 0; k < archives.size(); k++) {
+        const char* error = libs[k].open(archives[k].c_str(), config);
+        if (error != NULL){
+            out.put(error);
+            out.put(archives[k].c_str());
+            out.put(".\n");
+            return false;
+        }
+    }
+    int inputModules = program.moduleCount();
+    vector<bool> defined(symbolTable.entries.size(), false);
+    for (int k = 0; k < program.defSym.size(); k++) {
+        defined[program.defSym[k]] = true;
+    }
+    vector<vector<bool> > pulled(libs.size());
+    for (int k = 0; k < libs.size(); k++) {
+        pulled[k].assign(libs[k].header.moduleCount, false);
+    }
+    vector<int> refs;
+    for (int i = 0; i < program.moduleCount(); i++) {
+        referencedSymbols(program, i, refs);
+        for (int r = 0; r < refs.size(); r++) {
+            int sym = refs[r];
+            if (defined[sym]){
+                continue;
+            }
+            for (int k = 0; k < libs.size(); k++) {
+                int m = libs[k].find(symbolTable.name(sym), symbolTable.entries[sym].length);
+                if (m < 0){
+                    continue;
+                }
+                if (!pulled[k][m]){
+                    pulled[k][m] = true;
+                    int modules = program.moduleCount();
+                    if (!loadModule(libs[k].member(m), -1)){
+                        out.put("Invalid archive ");
+                        out.put(archives[k].c_str());
+                        out.put(".\n");
+                        return false;
+                    }
+                    num_instr += program.moduleBase[modules+1] - program.moduleBase[modules];
+                    if (num_instr > config.machineSize){
+                        out.put("Modules from archives exceed the machine size.\n");
+                        return false;
+                    }
+                    defined.resize(symbolTable.entries.size(), false);
+                    for (int d = program.defBase[modules]; d < program.defBase[modules+1]; d++) {
+                        defined[program.defSym[d]] = true;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    if (cache != NULL && program.moduleCount() > inputModules){
+        hashModules(program, inputModules);
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Time the linker on generated inputs of growing size and report
+# throughput in instructions and input bytes per second.
+#
+# usage: bench.sh [linker] [gen]
+# SIZES   module counts to run            (default "1000 10000 100000 200000")
+# INSTRS  instructions per module         (default 10)
+# DEFS    definitions per module          (default 2)
+# USES    uselist entries per module      (default 4)
+# ERRORS  error rate given to gen -e      (default 0.01)
+# RUNS    runs per size, best one counts  (default 3)
+#
+# The machine is as large as each input, and the words are given just
+# enough digits for gen's absolute address errors to reach past it; gen
+# and the linker get the same machine size and word width.
+
+LINKER=${1:-./linker}
+GEN=${2:-./gen}
+SIZES=${SIZES:-"1000 10000 100000 200000"}
+INSTRS=${INSTRS:-10}
+DEFS=${DEFS:-2}
+USES=${USES:-4}
+ERRORS=${ERRORS:-0.01}
+RUNS=${RUNS:-3}
+
+WORKDIR=`mktemp -d`
+trap "rm -fR ${WORKDIR}" EXIT
+
+printf "%10s %10s %12s %10s %14s %12s\n" "modules" "instrs" "bytes" "seconds" "instrs/sec" "MB/sec"
+for m in ${SIZES}; do
+	IN=${WORKDIR}/input-${m}
+	TOTAL=$((m * INSTRS))
+	WIDTH=4
+	while (( 10 ** (WIDTH - 1) < TOTAL + 2 )); do
+		WIDTH=$((WIDTH + 1))
+	done
+	${GEN} -m ${m} -d ${DEFS} -u ${USES} -i ${INSTRS} -M ${TOTAL} -w ${WIDTH} -e ${ERRORS} -s ${m} > ${IN} || exit 1
+	BYTES=`wc -c < ${IN}`
+	BEST=0
+	for r in `seq 1 ${RUNS}`; do
+		START=`date +%s%N`
+		${LINKER} --machine-size ${TOTAL} --word-width ${WIDTH} --max-uses ${USES} --max-defs ${DEFS} ${IN} > /dev/null || exit 1
+		END=`date +%s%N`
+		NS=$((END - START))
+		if [[ ${BEST} == 0 || ${NS} -lt ${BEST} ]]; then
+			BEST=${NS}
+		fi
+	done
+	awk -v m=${m} -v t=${TOTAL} -v b=${BYTES} -v ns=${BEST} 'BEGIN {
+		s = ns / 1e9
+		printf "%10d %10d %12d %10.4f %14.0f %12.2f\n", m, t, b, s, t / s, b / s / 1e6
+	}'
+done
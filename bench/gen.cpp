@@ -0,0 +1,190 @@
+/* File: gen.cpp
+ * Program: synthetic input generator for the two-pass linker
+ * Usage: gen [-m <modules>] [-d <defs>] [-u <uses>] [-i <instrs>]
+ *            [-M <machine size>] [-w <word width>]
+ *            [-e <error rate>] [-p] [-s <seed>]
+ *
+ * Writes a linker input with the given number of modules to stdout.
+ * Every module defines up to <defs> symbols, has <uses> uselist entries
+ * and <instrs> instructions, words of <word width> digits (4). With -e a
+ * fraction of the instructions and uselists is turned into the errors
+ * and warnings the linker reports for a machine of <machine size> words
+ * (512), so link with the same --machine-size and --word-width. With -p
+ * the input ends with a parse error.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+using namespace std;
+
+struct GenConfig{
+    int modules;
+    int defs;
+    int uses;
+    int instrs;
+    int machineSize;
+    int wordWidth;
+    double errorRate;
+    bool parseError;
+    unsigned seed;
+};
+
+string symName(int n);
+int power10(int n);
+void writeModule(FILE* out, const GenConfig& cfg, int module, mt19937& rng);
+void usage();
+
+int main(int argc, char* argv[]) {
+    GenConfig cfg;
+    cfg.modules = 1000;
+    cfg.defs = 2;
+    cfg.uses = 4;
+    cfg.instrs = 10;
+    cfg.machineSize = 512;
+    cfg.wordWidth = 4;
+    cfg.errorRate = 0;
+    cfg.parseError = false;
+    cfg.seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0){
+            cfg.parseError = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "-m") == 0){
+            cfg.modules = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-d") == 0){
+            cfg.defs = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-u") == 0){
+            cfg.uses = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-i") == 0){
+            cfg.instrs = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-M") == 0){
+            cfg.machineSize = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-w") == 0){
+            cfg.wordWidth = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-e") == 0){
+            cfg.errorRate = atof(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0){
+            cfg.seed = strtoul(argv[++i], NULL, 10);
+        } else{
+            usage();
+            return 1;
+        }
+    }
+    if (cfg.modules < 1 || cfg.defs < 0 || cfg.uses < 0 || cfg.instrs < 1
+        || cfg.machineSize < 1 || cfg.wordWidth < 2 || cfg.wordWidth > 9){
+        usage();
+        return 1;
+    }
+    if (cfg.errorRate > 0 && cfg.machineSize + 1 >= power10(cfg.wordWidth - 1)){
+        fprintf(stderr, "gen: with -e the operands of %d-digit words must reach past the machine size,"
+                " raise -w or lower -M\n", cfg.wordWidth);
+        return 1;
+    }
+    mt19937 rng(cfg.seed);
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    for (int m = 0; m < cfg.modules; m++) {
+        writeModule(stdout, cfg, m, rng);
+    }
+    if (cfg.parseError){
+        fprintf(stdout, "1 %s\n", symName(0).c_str());
+    }
+    return 0;
+}
+
+int power10(int n){
+    int p = 1;
+    while (n-- > 0) {
+        p *= 10;
+    }
+    return p;
+}
+
+/* Symbol n is "s" followed by n in base 36 */
+string symName(int n){
+    const char* digits = "0123456789abcdefghijklmnopqrstuvwxyz";
+    string name;
+    do {
+        name.insert(name.begin(), digits[n % 36]);
+        n /= 36;
+    } while (n != 0);
+    return "s" + name;
+}
+
+/* Module m defines symbols m*defs .. m*defs+defs-1 and uses symbols
+ * defined by random modules, so most symbols are both defined and used
+ */
+void writeModule(FILE* out, const GenConfig& cfg, int module, mt19937& rng){
+    uniform_real_distribution<double> chance(0.0, 1.0);
+    bool seeded = cfg.errorRate > 0;
+    int codeCount = cfg.instrs;
+    long long limit = power10(cfg.wordWidth);
+    int scale = power10(cfg.wordWidth - 1);
+
+    fprintf(out, "%d", cfg.defs);
+    for (int k = 0; k < cfg.defs; k++) {
+        int sym = module*cfg.defs + k;
+        int rel = rng() % codeCount;
+        if (seeded && chance(rng) < cfg.errorRate){
+            sym = rng() % (sym + 1);          /* possibly defined twice */
+        }
+        if (seeded && chance(rng) < cfg.errorRate){
+            rel = codeCount + rng() % 10;     /* too big for the module */
+        }
+        fprintf(out, " %s %d", symName(sym).c_str(), rel);
+    }
+    fprintf(out, "\n%d", cfg.uses);
+    int symbols = cfg.modules*cfg.defs;
+    for (int k = 0; k < cfg.uses; k++) {
+        int sym = symbols > 0 ? rng() % symbols : 0;
+        if (symbols == 0 || (seeded && chance(rng) < cfg.errorRate)){
+            sym = symbols + rng() % 1000;      /* never defined */
+        }
+        fprintf(out, " %s", symName(sym).c_str());
+    }
+    fprintf(out, "\n%d", codeCount);
+    for (int j = 0; j < codeCount; j++) {
+        int opcode = 1 + rng() % 9;
+        int kind = rng() % 4;
+        if (cfg.uses == 0 && kind == 3){
+            kind = 0;
+        }
+        bool error = seeded && chance(rng) < cfg.errorRate;
+        switch (kind) {
+        case 0:
+            if (error){
+                fprintf(out, " I %lld", limit + rng() % (9*limit));
+            } else{
+                fprintf(out, " I %d", opcode*scale + (int)(rng() % scale));
+            }
+            break;
+        case 1:
+            if (error){                        /* past the end of the machine */
+                int first = cfg.machineSize + 1;
+                fprintf(out, " A %d", opcode*scale + first + (int)(rng() % (scale - first)));
+            } else{
+                fprintf(out, " A %d", opcode*scale + (int)(rng() % min(cfg.machineSize, scale)));
+            }
+            break;
+        case 2:
+            if (error){                        /* one digit too many */
+                fprintf(out, " R %lld", opcode*limit + rng() % limit);
+            } else{
+                fprintf(out, " R %d", opcode*scale + (int)(rng() % min(codeCount, scale)));
+            }
+            break;
+        default:
+            fprintf(out, " E %d", opcode*scale + (int)(error ? cfg.uses + rng() % 5 : rng() % cfg.uses));
+            break;
+        }
+    }
+    fprintf(out, "\n");
+}
+
+void usage(){
+    fprintf(stderr, "usage: gen [-m <modules>] [-d <defs>] [-u <uses>] [-i <instrs>]\n"
+            "           [-M <machine size>] [-w <word width>]\n"
+            "           [-e <error rate>] [-p] [-s <seed>]\n");
+}
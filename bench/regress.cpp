@@ -0,0 +1,214 @@
+/* File: regress.cpp
+ * Program: golden output and timing check of the two-pass linker
+ * Usage: regress [-r <runs>] [-f <factor>] [-s <slack>] [-b <baseline>] [-u] [<samples>]
+ *
+ * Links every input-N of the samples directory in-process and compares
+ * the result with out-N the way gradeit.sh does: lines with "Warning"
+ * are compared as a sorted set, the other lines in order with blank
+ * lines dropped, and runs of blanks count as one. Each case is linked
+ * <runs> times and the best time is checked against the baseline file
+ * (<samples>/timings by default); a case fails when it takes more than
+ * <factor> times its baseline plus <slack> microseconds. -u writes the
+ * times of this run as the new baseline. Where the samples have an
+ * xref-N, the --xref report of input-N must match it line for line.
+ */
+#include "linker.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+struct Compared{
+    vector<string> lines;
+    vector<string> warnings;
+};
+
+static bool readText(const string& path, string& text){
+    ifstream in(path.c_str(), ios::binary);
+    if (!in.is_open()){
+        return false;
+    }
+    ostringstream all;
+    all << in.rdbuf();
+    text = all.str();
+    return true;
+}
+
+static vector<string> splitLines(const string& text){
+    vector<string> lines;
+    istringstream in(text);
+    string line;
+    while (getline(in, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+/* Split output into what gradeit.sh compares */
+static Compared normalize(const string& text){
+    Compared c;
+    istringstream in(text);
+    string line;
+    while (getline(in, line)) {
+        string squeezed;
+        for (int k = 0; k < line.size(); k++) {
+            bool blank = line[k] == ' ' || line[k] == '\t' || line[k] == '\r';
+            if (!blank){
+                squeezed += line[k];
+            } else if (squeezed.empty() || squeezed[squeezed.size()-1] != ' '){
+                squeezed += ' ';
+            }
+        }
+        while (!squeezed.empty() && squeezed[squeezed.size()-1] == ' ') {
+            squeezed.erase(squeezed.size() - 1);
+        }
+        if (line.find("Warning") != string::npos){
+            c.warnings.push_back(squeezed);
+        } else if (!squeezed.empty()){
+            c.lines.push_back(squeezed);
+        }
+    }
+    sort(c.warnings.begin(), c.warnings.end());
+    return c;
+}
+
+/* Describe the first difference in detail, return true if there is none */
+static bool same(const vector<string>& want, const vector<string>& got, const char* what, string& detail){
+    for (int k = 0; k < want.size() || k < got.size(); k++) {
+        const char* w = k < want.size() ? want[k].c_str() : "(none)";
+        const char* g = k < got.size() ? got[k].c_str() : "(none)";
+        if (strcmp(w, g) != 0){
+            ostringstream text;
+            text << "    " << what << " " << k + 1 << ": expected \"" << w << "\"\n"
+                 << "    " << string(strlen(what) + 3, ' ') << " got \"" << g << "\"\n";
+            detail += text.str();
+            return false;
+        }
+    }
+    return true;
+}
+
+static void readBaseline(const string& path, map<string, double>& baseline){
+    ifstream in(path.c_str());
+    string name;
+    double micros;
+    while (in >> name >> micros) {
+        baseline[name] = micros;
+    }
+}
+
+static void usage(){
+    fprintf(stderr, "usage: regress [-r <runs>] [-f <factor>] [-s <slack>] [-b <baseline>] [-u] [<samples>]\n");
+}
+
+int main(int argc, char* argv[]) {
+    int runs = 20;
+    double factor = 3.0;
+    double slack = 50;
+    bool update = false;
+    string dir = "lab1samples";
+    string baselinePath;
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc){
+            factor = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            slack = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "-u") == 0){
+            update = true;
+        } else{
+            break;
+        }
+    }
+    if (i < argc){
+        dir = argv[i++];
+    }
+    if (i != argc || runs < 1){
+        usage();
+        return 2;
+    }
+    if (baselinePath.empty()){
+        baselinePath = dir + "/timings";
+    }
+    map<string, double> baseline;
+    readBaseline(baselinePath, baseline);
+
+    Linker linker(-1);
+    string timings;
+    int cases = 0;
+    int failed = 0;
+    for (int n = 1; ; n++) {
+        ostringstream name;
+        ostringstream outName;
+        ostringstream xrefName;
+        name << "input-" << n;
+        outName << dir << "/out-" << n;
+        xrefName << dir << "/xref-" << n;
+        string input = dir + "/" + name.str();
+        string expected;
+        if (access(input.c_str(), R_OK) != 0){
+            break;
+        }
+        if (!readText(outName.str(), expected)){
+            printf("%-10s missing out-%d\n", name.str().c_str(), n);
+            failed++;
+            continue;
+        }
+        string expectedXref;
+        bool checkXref = readText(xrefName.str(), expectedXref);
+        double best = 0;
+        string output;
+        string xref;
+        for (int r = 0; r < runs; r++) {
+            linker.reset();
+            linker.out.clear();
+            double start = LinkStats::now();
+            linker.link(input.c_str());
+            double micros = (LinkStats::now() - start) * 1e6;
+            if (r == 0 || micros < best){
+                best = micros;
+            }
+            if (r == 0){
+                output.assign(linker.out.data, linker.out.used);
+            }
+            if (r == 0 && checkXref){
+                OutBuf buf(-1);
+                linker.putXref(buf);
+                xref.assign(buf.data, buf.used);
+            }
+        }
+        cases++;
+        Compared want = normalize(expected);
+        Compared got = normalize(output);
+        string detail;
+        bool correct = same(want.lines, got.lines, "line", detail);
+        correct = same(want.warnings, got.warnings, "warning", detail) && correct;
+        if (checkXref){
+            correct = same(splitLines(expectedXref), splitLines(xref), "xref", detail) && correct;
+        }
+        bool slow = false;
+        map<string, double>::const_iterator it = baseline.find(name.str());
+        printf("%-10s %-4s %10.1f us", name.str().c_str(), correct ? "ok" : "FAIL", best);
+        if (it != baseline.end()){
+            slow = !update && best > it->second * factor + slack;
+            printf("  baseline %10.1f us%s", it->second, slow ? "  SLOW" : "");
+        }
+        printf("\n%s", detail.c_str());
+        if (!correct || slow){
+            failed++;
+        }
+        ostringstream line;
+        line << name.str() << " " << best << "\n";
+        timings += line.str();
+    }
+    if (update && !writeFile(baselinePath.c_str(), timings)){
+        fprintf(stderr, "regress: cannot write %s\n", baselinePath.c_str());
+        return 2;
+    }
+    printf("%d of %d cases passed\n", cases - failed, cases);
+    return failed == 0 && cases > 0 ? 0 : 1;
+}
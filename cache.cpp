@@ -0,0 +1,409 @@
+/* File: cache.cpp
+ * Program: two-pass linker
+ * Persistent parsed-module and memory map cache for incremental relinking
+ *
+ * The cache file is "LKC1", the machine configuration it was made with,
+ * the number of module records and of segment records, then the records,
+ * each a 64-bit key, a 32-bit size and that many bytes. A file made with
+ * another configuration, or one that is damaged, is ignored.
+ */
+#include "linker.h"
+#include <cstdio>
+
+static const char cacheMagic[4] = {'L', 'K', 'C', '1'};
+
+/* Append raw bytes of a value to a record */
+template<typename T>
+static void putRaw(string& s, T v){
+    s.append((const char*)&v, sizeof(v));
+}
+
+/* Bounds-checked reader over a record */
+struct RecordReader{
+    const char* p;
+    const char* end;
+    bool ok;
+
+    RecordReader(const char* data, size_t size): p(data), end(data + size), ok(true) {}
+    template<typename T>
+    T get(){
+        T v = 0;
+        if (end - p < (ptrdiff_t)sizeof(v)){
+            ok = false;
+            return v;
+        }
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return v;
+    }
+    const char* bytes(size_t n){
+        if (end - p < (ptrdiff_t)n){
+            ok = false;
+            return NULL;
+        }
+        const char* s = p;
+        p += n;
+        return s;
+    }
+};
+
+LinkCache::~LinkCache(){
+    release();
+}
+
+void LinkCache::release(){
+    if (mapped != NULL){
+        munmap(mapped, mappedSize);
+        mapped = NULL;
+        mappedSize = 0;
+    }
+    modules.clear();
+    segments.clear();
+    fresh.clear();
+}
+
+/* Map the cache file, a missing or unusable file gives an empty cache */
+void LinkCache::load(const char* cachePath, const MachineConfig& linkConfig){
+    release();
+    path = cachePath;
+    config = linkConfig;
+    int fd = open(cachePath, O_RDONLY);
+    struct stat st;
+    if (fd < 0){
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        return;
+    }
+    mapped = (char*)data;
+    mappedSize = st.st_size;
+
+    RecordReader header(mapped, mappedSize);
+    const char* magic = header.bytes(sizeof(cacheMagic));
+    int fields[5];
+    for (int k = 0; k < 5; k++) {
+        fields[k] = header.get<int>();
+    }
+    unsigned moduleCount = header.get<unsigned>();
+    unsigned segmentCount = header.get<unsigned>();
+    bool usable = header.ok && memcmp(magic, cacheMagic, sizeof(cacheMagic)) == 0
+                  && fields[0] == config.machineSize && fields[1] == config.maxDefs
+                  && fields[2] == config.maxUses && fields[3] == config.wordWidth
+                  && fields[4] == config.labelWidth;
+    const char* p = header.p;
+    const char* end = mapped + mappedSize;
+    if (!usable || !readRecords(p, end, moduleCount, modules) || !readRecords(p, end, segmentCount, segments)){
+        release();
+    }
+}
+
+bool LinkCache::readRecords(const char*& p, const char* end, unsigned count,
+                            unordered_map<unsigned long long, CacheRecord>& table){
+    RecordReader reader(p, end - p);
+    for (unsigned k = 0; k < count; k++) {
+        unsigned long long key = reader.get<unsigned long long>();
+        unsigned size = reader.get<unsigned>();
+        CacheRecord record;
+        record.data = reader.bytes(size);
+        record.size = size;
+        record.kept = false;
+        if (!reader.ok){
+            return false;
+        }
+        table[key] = record;
+    }
+    p = reader.p;
+    return true;
+}
+
+/* Return the record with this key and keep it for the next link */
+const CacheRecord* LinkCache::find(unordered_map<unsigned long long, CacheRecord>& table, unsigned long long key){
+    unordered_map<unsigned long long, CacheRecord>::iterator it = table.find(key);
+    if (it == table.end()){
+        return NULL;
+    }
+    it->second.kept = true;
+    return &it->second;
+}
+
+void LinkCache::add(unordered_map<unsigned long long, CacheRecord>& table, unsigned long long key,
+                    const char* data, size_t size){
+    fresh.push_back(string(data, size));
+    CacheRecord record;
+    record.data = fresh.back().data();
+    record.size = size;
+    record.kept = true;
+    table[key] = record;
+}
+
+/* Write the kept records to a temporary file and move it into place,
+ * so an interrupted link never leaves a half-written cache behind
+ */
+bool LinkCache::save(){
+    string image(cacheMagic, sizeof(cacheMagic));
+    putRaw(image, config.machineSize);
+    putRaw(image, config.maxDefs);
+    putRaw(image, config.maxUses);
+    putRaw(image, config.wordWidth);
+    putRaw(image, config.labelWidth);
+    unordered_map<unsigned long long, CacheRecord>* tables[2] = {&modules, &segments};
+    for (int t = 0; t < 2; t++) {
+        unsigned count = 0;
+        unordered_map<unsigned long long, CacheRecord>::iterator it;
+        for (it = tables[t]->begin(); it != tables[t]->end(); ++it) {
+            count += it->second.kept;
+        }
+        putRaw(image, count);
+    }
+    for (int t = 0; t < 2; t++) {
+        unordered_map<unsigned long long, CacheRecord>::iterator it;
+        for (it = tables[t]->begin(); it != tables[t]->end(); ++it) {
+            if (it->second.kept){
+                putRaw(image, it->first);
+                putRaw(image, (unsigned)it->second.size);
+                image.append(it->second.data, it->second.size);
+            }
+        }
+    }
+    string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return false;
+    }
+    const char* s = image.data();
+    size_t n = image.size();
+    while (n > 0) {
+        ssize_t count = write(fd, s, n);
+        if (count < 0 && errno == EINTR){
+            continue;
+        }
+        if (count <= 0){
+            close(fd);
+            unlink(temp.c_str());
+            return false;
+        }
+        s += count;
+        n -= count;
+    }
+    if (close(fd) != 0 || rename(temp.c_str(), path.c_str()) != 0){
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Hash token lengths and text, so "ab c" and "a bc" differ */
+unsigned long long LinkCache::hashTokens(const Token* first, int count){
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < count; i++) {
+        h = (h ^ first[i].length) * 0x100000001B3ULL;
+        for (int k = 0; k < first[i].length; k++) {
+            h = (h ^ (unsigned char)first[i].text[k]) * 0x100000001B3ULL;
+        }
+    }
+    return h;
+}
+
+unsigned long long LinkCache::mix(unsigned long long h, unsigned long long v){
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+/* Take the module at tokenPointer from the cache
+ * The module's extent is found from its three counts alone, anything
+ * the cache cannot vouch for (a count out of range, a module running
+ * past the input, too many instructions) is left to parseModule, which
+ * reports the error exactly where a full parse would
+ */
+bool Linker::reuseModule(){
+    int totalToken = token.size();
+    int limit[3] = {config.maxDefs, config.maxUses, INT_MAX};
+    int width[3] = {2, 1, 2};
+    int count[3];
+    long long p = tokenPointer;
+    for (int k = 0; k < 3; k++) {
+        if (p >= totalToken || !isNum(token[p])){
+            return false;
+        }
+        count[k] = turnToInt(token[p]);
+        p += 1 + (long long)count[k]*width[k];
+        if (count[k] > limit[k] || p > totalToken){
+            return false;
+        }
+    }
+    if (num_instr + (long long)count[2] > config.machineSize){
+        return false;
+    }
+    unsigned long long key = LinkCache::hashTokens(&token[tokenPointer], p - tokenPointer);
+    const CacheRecord* record = cache->find(cache->modules, key);
+    if (record == NULL || !loadModule(*record, count[2])){
+        return false;
+    }
+    moduleHash.push_back(key);
+    num_instr += count[2];
+    tokenPointer = p;
+    return true;
+}
+
+/* Append a module record to the program, undoing everything if the
+ * record turns out to be damaged. A codeCount below zero takes any size
+ */
+bool Linker::loadModule(const CacheRecord& record, int codeCount){
+    ModuleIR& ir = program;
+    size_t defs = ir.defSym.size();
+    size_t uses = ir.useSym.size();
+    size_t instrs = ir.word.size();
+    RecordReader reader(record.data, record.size);
+    int defCount = reader.get<int>();
+    for (int k = 0; k < defCount && reader.ok; k++) {
+        unsigned char length = reader.get<unsigned char>();
+        const char* name = reader.bytes(length);
+        int rel = reader.get<int>();
+        if (reader.ok && length > 0 && length <= 16){
+            ir.defSym.push_back(symbolTable.intern(name, length));
+            ir.defRel.push_back(rel);
+        } else{
+            reader.ok = false;
+        }
+    }
+    int useCount = reader.get<int>();
+    for (int k = 0; k < useCount && reader.ok; k++) {
+        unsigned char length = reader.get<unsigned char>();
+        const char* name = reader.bytes(length);
+        if (reader.ok && length > 0 && length <= 16){
+            ir.useSym.push_back(symbolTable.intern(name, length));
+        } else{
+            reader.ok = false;
+        }
+    }
+    int recordCount = reader.get<int>();
+    if (codeCount >= 0 && recordCount != codeCount){
+        reader.ok = false;
+    }
+    codeCount = recordCount;
+    for (int k = 0; k < codeCount && reader.ok; k++) {
+        unsigned char type = reader.get<unsigned char>();
+        unsigned char digits = reader.get<unsigned char>();
+        unsigned char opcode = reader.get<unsigned char>();
+        int operand = reader.get<int>();
+        int word = reader.get<int>();
+        if (reader.ok && type <= TYPE_E){
+            ir.type.push_back(type);
+            ir.digits.push_back(digits);
+            ir.opcode.push_back(opcode);
+            ir.operand.push_back(operand);
+            ir.word.push_back(word);
+        } else{
+            reader.ok = false;
+        }
+    }
+    if (!reader.ok || reader.p != reader.end){
+        ir.defSym.resize(defs);
+        ir.defRel.resize(defs);
+        ir.useSym.resize(uses);
+        ir.type.resize(instrs);
+        ir.digits.resize(instrs);
+        ir.opcode.resize(instrs);
+        ir.operand.resize(instrs);
+        ir.word.resize(instrs);
+        return false;
+    }
+    ir.defBase.push_back(ir.defSym.size());
+    ir.useBase.push_back(ir.useSym.size());
+    ir.moduleBase.push_back(ir.word.size());
+    return true;
+}
+
+/* Store the module just parsed from token[first] on. This runs before
+ * pass two, which may still zero a relative address that is too big
+ */
+void Linker::cacheModule(int first){
+    string record;
+    moduleRecord(program.moduleCount() - 1, record);
+    unsigned long long key = LinkCache::hashTokens(&token[first], tokenPointer - first);
+    cache->add(cache->modules, key, record.data(), record.size());
+    moduleHash.push_back(key);
+}
+
+/* Encode module i with its symbol names, so the record does not depend
+ * on the ids of this link; loadModule reads it back
+ */
+void Linker::moduleRecord(int i, string& record) const{
+    const ModuleIR& ir = program;
+    record.clear();
+    putRaw(record, ir.defBase[i+1] - ir.defBase[i]);
+    for (int k = ir.defBase[i]; k < ir.defBase[i+1]; k++) {
+        putRaw(record, (unsigned char)symbolTable.entries[ir.defSym[k]].length);
+        record.append(symbolTable.name(ir.defSym[k]), symbolTable.entries[ir.defSym[k]].length);
+        putRaw(record, ir.defRel[k]);
+    }
+    putRaw(record, ir.useBase[i+1] - ir.useBase[i]);
+    for (int k = ir.useBase[i]; k < ir.useBase[i+1]; k++) {
+        putRaw(record, (unsigned char)symbolTable.entries[ir.useSym[k]].length);
+        record.append(symbolTable.name(ir.useSym[k]), symbolTable.entries[ir.useSym[k]].length);
+    }
+    putRaw(record, ir.moduleBase[i+1] - ir.moduleBase[i]);
+    for (int j = ir.moduleBase[i]; j < ir.moduleBase[i+1]; j++) {
+        putRaw(record, ir.type[j]);
+        putRaw(record, ir.digits[j]);
+        putRaw(record, ir.opcode[j]);
+        putRaw(record, ir.operand[j]);
+        putRaw(record, ir.word[j]);
+    }
+}
+
+/* Memory map from the cache: a module's text depends only on the module,
+ * its number, its base and the values of the symbols it uses, so only
+ * modules where one of these changed are relocated again
+ */
+void Linker::relocateCached(const ModuleIR& ir){
+    if (chunkOut.empty()){
+        chunkOut.push_back(new OutBuf(-1));
+    }
+    OutBuf& scratch = *chunkOut[0];
+    scratch.wordWidth = config.wordWidth;
+    scratch.labelWidth = config.labelWidth;
+    int* usedStamp = arena.allocZero<int>(symbolTable.entries.size());
+    for (int i = 0; i < ir.moduleCount(); i++) {
+        unsigned long long key = LinkCache::mix(moduleHash[i], i);
+        key = LinkCache::mix(key, ir.moduleBase[i]);
+        for (int k = ir.useBase[i]; k < ir.useBase[i+1]; k++) {
+            const SymEntry& entry = symbolTable.entries[ir.useSym[k]];
+            key = LinkCache::mix(key, entry.defined ? entry.value : -1);
+        }
+        const CacheRecord* record = cache->find(cache->segments, key);
+        if (record != NULL){
+            out.put(record->data, record->size);
+            continue;
+        }
+        scratch.clear();
+        relocateModule(ir, i, i, ir.moduleBase[i], scratch, usedStamp);
+        cache->add(cache->segments, key, scratch.data, scratch.used);
+        out.put(scratch.data, scratch.used);
+    }
+}
+
+/* Key modules [first, end) that have no tokens to hash, those of an
+ * object file or an archive, by what their memory map text is made of
+ */
+void Linker::hashModules(const ModuleIR& ir, int first){
+    moduleHash.resize(first);
+    for (int i = first; i < ir.moduleCount(); i++) {
+        unsigned long long h = LinkCache::mix(ir.useBase[i+1] - ir.useBase[i], ir.moduleBase[i+1] - ir.moduleBase[i]);
+        for (int k = ir.useBase[i]; k < ir.useBase[i+1]; k++) {
+            const SymEntry& entry = symbolTable.entries[ir.useSym[k]];
+            h = LinkCache::mix(LinkCache::mix(h, entry.key.w[0]), entry.key.w[1]);
+        }
+        for (int j = ir.moduleBase[i]; j < ir.moduleBase[i+1]; j++) {
+            h = LinkCache::mix(h, ir.type[j] | ir.digits[j] << 8 | ir.opcode[j] << 16);
+            h = LinkCache::mix(h, (unsigned long long)(unsigned)ir.operand[j] << 32 | (unsigned)ir.word[j]);
+        }
+        moduleHash.push_back(h);
+    }
+}
@@ -0,0 +1,152 @@
+/* File: gc.cpp
+ * Program: two-pass linker
+ * Dead module elimination (--gc-sections): only the modules reachable
+ * from the roots through uselist references are linked
+ */
+#include "linker.h"
+
+/* Mark the modules reachable from the roots. A module reaches the module
+ * that first defines each symbol of its uselist, the definition the
+ * symbol table would use
+ * Return false if a root does not exist
+ */
+bool Linker::markLive(const ModuleIR& ir, bool* live){
+    int modules = ir.moduleCount();
+    int symbols = symbolTable.entries.size();
+    int* definer = arena.alloc<int>(symbols);
+    int* pending = arena.alloc<int>(modules);
+    int count = 0;
+    for (int s = 0; s < symbols; s++) {
+        definer[s] = -1;
+    }
+    for (int i = modules - 1; i >= 0; i--) {
+        for (int k = ir.defBase[i]; k < ir.defBase[i+1]; k++) {
+            definer[ir.defSym[k]] = i;
+        }
+    }
+    vector<int> roots;
+    for (int r = 0; r < gcRoots.size(); r++) {
+        if (gcRoots[r] < 1 || gcRoots[r] > modules){
+            out.put("Root module ");
+            out.putInt(gcRoots[r]);
+            out.put(" does not exist.\n");
+            return false;
+        }
+        roots.push_back(gcRoots[r] - 1);
+    }
+    if (!entry.empty()){
+        int sym = symbolTable.find(entry.c_str(), entry.size());
+        if (sym < 0 || definer[sym] < 0){
+            out.put("Entry symbol ");
+            out.put(entry.c_str());
+            out.put(" is not defined.\n");
+            return false;
+        }
+        roots.push_back(definer[sym]);
+    }
+    if (roots.empty() && modules > 0){
+        roots.push_back(0);
+    }
+    for (int r = 0; r < roots.size(); r++) {
+        if (!live[roots[r]]){
+            live[roots[r]] = true;
+            pending[count++] = roots[r];
+        }
+    }
+    while (count > 0) {
+        int i = pending[--count];
+        for (int k = ir.useBase[i]; k < ir.useBase[i+1]; k++) {
+            int d = definer[ir.useSym[k]];
+            if (d >= 0 && !live[d]){
+                live[d] = true;
+                pending[count++] = d;
+            }
+        }
+    }
+    return true;
+}
+
+/* Drop the modules the roots cannot reach and load the rest one after
+ * another from address zero. The arrays are compacted in place and the
+ * symbol table is rebuilt from the modules kept, in order of appearance,
+ * so pass two relocates against the new layout as if the input held
+ * only those modules. The space saved goes to the statistics
+ * Return false if a root does not exist
+ */
+bool Linker::collectModules(){
+    ModuleIR& ir = program;
+    int modules = ir.moduleCount();
+    int words = ir.moduleBase[modules];
+    bool* live = arena.allocZero<bool>(modules);
+    if (!markLive(ir, live)){
+        return false;
+    }
+    SymbolTable kept;
+    int* remap = arena.alloc<int>(symbolTable.entries.size());
+    for (int s = 0; s < symbolTable.entries.size(); s++) {
+        remap[s] = -1;
+    }
+    int m = 0;
+    int defAt = 0;
+    int useAt = 0;
+    int codeAt = 0;
+    for (int i = 0; i < modules; i++) {
+        if (!live[i]){
+            continue;
+        }
+        int defFirst = ir.defBase[i];
+        int defLast = ir.defBase[i+1];
+        int useFirst = ir.useBase[i];
+        int useLast = ir.useBase[i+1];
+        int codeFirst = ir.moduleBase[i];
+        int codeLast = ir.moduleBase[i+1];
+        ir.defBase[m] = defAt;
+        ir.useBase[m] = useAt;
+        ir.moduleBase[m] = codeAt;
+        for (int k = defFirst; k < defLast; k++, defAt++) {
+            int s = ir.defSym[k];
+            if (remap[s] < 0){
+                remap[s] = kept.intern(symbolTable.name(s), symbolTable.entries[s].length);
+            }
+            ir.defSym[defAt] = remap[s];
+            ir.defRel[defAt] = ir.defRel[k];
+        }
+        for (int k = useFirst; k < useLast; k++, useAt++) {
+            int s = ir.useSym[k];
+            if (remap[s] < 0){
+                remap[s] = kept.intern(symbolTable.name(s), symbolTable.entries[s].length);
+            }
+            ir.useSym[useAt] = remap[s];
+        }
+        for (int j = codeFirst; j < codeLast; j++, codeAt++) {
+            ir.type[codeAt] = ir.type[j];
+            ir.digits[codeAt] = ir.digits[j];
+            ir.opcode[codeAt] = ir.opcode[j];
+            ir.operand[codeAt] = ir.operand[j];
+            ir.word[codeAt] = ir.word[j];
+        }
+        m++;
+    }
+    ir.defBase[m] = defAt;
+    ir.useBase[m] = useAt;
+    ir.moduleBase[m] = codeAt;
+    ir.defBase.resize(m + 1);
+    ir.useBase.resize(m + 1);
+    ir.moduleBase.resize(m + 1);
+    ir.defSym.resize(defAt);
+    ir.defRel.resize(defAt);
+    ir.useSym.resize(useAt);
+    ir.type.resize(codeAt);
+    ir.digits.resize(codeAt);
+    ir.opcode.resize(codeAt);
+    ir.operand.resize(codeAt);
+    ir.word.resize(codeAt);
+    num_instr = codeAt;
+    swap(symbolTable, kept);
+
+    if (stats != NULL){
+        stats->removedModules = modules - m;
+        stats->removedWords = words - codeAt;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+/* File: image.cpp
+ * Program: two-pass linker
+ * Executable images: the relocated words of a link with its module bases
+ * and symbol table, written by --image for loaders that map the file
+ * instead of reading the memory map text
+ */
+#include "linker.h"
+
+const char imgMagic[8] = {'\177', 'L', 'K', 'I', 'M', 'G', '1', '\n'};
+
+/* Relocate the program into the image file. The output gets only the
+ * diagnostics: symbols defined more than once, a line "NNN: Error: ..."
+ * for every word with an error, and the warnings
+ */
+void Linker::writeImage(const ModuleIR& ir){
+    ImgHeader header;
+    memcpy(header.magic, imgMagic, sizeof(imgMagic));
+    header.wordWidth = config.wordWidth;
+    header.moduleCount = ir.moduleCount();
+    header.symbolCount = symbolTable.definedOrder.size();
+    header.wordCount = ir.moduleBase.back();
+
+    string image((const char*)&header, sizeof(header));
+    image.append((const char*)&ir.moduleBase[0], ir.moduleBase.size() * sizeof(int));
+    for (int k = 0; k < header.symbolCount; k++) {
+        int sym = symbolTable.definedOrder[k];
+        const SymEntry& entry = symbolTable.entries[sym];
+        ImgSymbol symbol;
+        memcpy(symbol.name, entry.key.w, sizeof(symbol.name));
+        symbol.length = entry.length;
+        symbol.value = entry.value;
+        image.append((const char*)&symbol, sizeof(symbol));
+        if (entry.duplicate){
+            putSym(out, sym);
+            out.putChar('=');
+            out.putInt(entry.value);
+            out.put(" Error: This variable is multiple times defined; first value used\n");
+        }
+    }
+    size_t wordsAt = image.size();
+    image.resize(wordsAt + (size_t)header.wordCount * sizeof(int));
+    out.wordWidth = config.wordWidth;
+    out.labelWidth = config.labelWidth;
+    relocateAll(ir, (int*)&image[wordsAt]);
+    if (!writeFile(imageFile.c_str(), image)){
+        out.put("Cannot write image file ");
+        out.put(imageFile.c_str());
+        out.put(".\n");
+    }
+}
@@ -0,0 +1,198 @@
+/* File: io.cpp
+ * Program: two-pass linker
+ * Queued file I/O for batch links: whole-file reads and writes on an
+ * io_uring, driven through the raw system calls, or done on the spot
+ * with pread and pwrite where there is no ring
+ */
+#include "linker.h"
+#include <algorithm>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Largest piece handed to one read or write */
+static const size_t ioPiece = 1 << 30;
+
+static int ringEnter(int fd, unsigned submit, unsigned complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+IoQueue::IoQueue(): ringFd(-1), sqRing(NULL), cqRing(NULL), sqes(NULL), sqRingSize(0), cqRingSize(0), sqesSize(0){
+}
+
+IoQueue::~IoQueue(){
+    release();
+}
+
+/* Create the ring and map its queues, false if the kernel has none to
+ * give; the queue then works without one
+ */
+bool IoQueue::setup(){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, ringEntries, &params);
+    if (ringFd < 0){
+        return false;
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single){
+        sqRingSize = max(sqRingSize, cqRingSize);
+        cqRingSize = 0;
+    }
+    void* sq = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    sqRing = sq == MAP_FAILED ? NULL : (char*)sq;
+    if (sqRing != NULL && !single){
+        void* cq = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        cqRing = cq == MAP_FAILED ? NULL : (char*)cq;
+    } else{
+        cqRing = sqRing;
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* entries = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    sqes = entries == MAP_FAILED ? NULL : entries;
+    if (sqRing == NULL || cqRing == NULL || sqes == NULL){
+        release();
+        return false;
+    }
+    sqTail = (unsigned*)(sqRing + params.sq_off.tail);
+    sqMask = (unsigned*)(sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sqRing + params.sq_off.array);
+    cqHead = (unsigned*)(cqRing + params.cq_off.head);
+    cqTail = (unsigned*)(cqRing + params.cq_off.tail);
+    cqMask = (unsigned*)(cqRing + params.cq_off.ring_mask);
+    cqes = cqRing + params.cq_off.cqes;
+    return true;
+}
+
+void IoQueue::release(){
+    if (sqes != NULL){
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != NULL && cqRing != sqRing){
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != NULL){
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0){
+        close(ringFd);
+    }
+    ringFd = -1;
+    sqRing = NULL;
+    cqRing = NULL;
+    sqes = NULL;
+}
+
+/* Begin a transfer, it must stay in place until wait returns */
+void IoQueue::start(IoTransfer& t){
+    t.done = 0;
+    t.failed = false;
+    t.busy = true;
+    if (ringFd < 0 || t.size == 0){
+        transferNow(t);
+        return;
+    }
+    queue(t);
+}
+
+/* Submit the rest of a transfer, at most ioPiece bytes of it. The kernel
+ * takes entries only while in io_uring_enter, so an entry it refused is
+ * taken back and the transfer is finished on the spot
+ */
+void IoQueue::queue(IoTransfer& t){
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = t.writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = t.fd;
+    sqe->addr = (unsigned long long)(t.data + t.done);
+    sqe->len = min(t.size - t.done, ioPiece);
+    sqe->off = t.done;
+    sqe->user_data = (unsigned long long)&t;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    int submitted;
+    while ((submitted = ringEnter(ringFd, 1, 0, 0)) < 0 && errno == EINTR) {
+    }
+    if (submitted != 1){
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        transferNow(t);
+    }
+}
+
+/* Wait until a transfer is finished, whatever else completes meanwhile
+ * A ring that stops delivering completions fails the transfer
+ */
+void IoQueue::wait(IoTransfer& t){
+    while (t.busy) {
+        if (!reap()){
+            t.failed = true;
+            t.busy = false;
+        }
+    }
+}
+
+/* Take every completion there is, waiting for one if there is none
+ * Return false if the ring cannot be waited on
+ */
+bool IoQueue::reap(){
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)
+        && ringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+        return false;
+    }
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = (struct io_uring_cqe*)cqes + (head & *cqMask);
+        IoTransfer& t = *(IoTransfer*)cqe->user_data;
+        int result = cqe->res;
+        head++;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        complete(t, result);
+    }
+    return true;
+}
+
+void IoQueue::complete(IoTransfer& t, int result){
+    if (result == -EINTR || result == -EAGAIN){
+        queue(t);
+    } else if (result == -EINVAL || result == -EOPNOTSUPP){
+        /* A kernel without this operation */
+        transferNow(t);
+    } else if (result < 0 || (result == 0 && t.writing)){
+        t.failed = true;
+        t.busy = false;
+    } else if (result == 0){
+        t.size = t.done;
+        t.busy = false;
+    } else{
+        t.done += result;
+        if (t.done < t.size){
+            queue(t);
+        } else{
+            t.busy = false;
+        }
+    }
+}
+
+void IoQueue::transferNow(IoTransfer& t){
+    while (t.done < t.size) {
+        size_t n = min(t.size - t.done, ioPiece);
+        ssize_t count = t.writing ? pwrite(t.fd, t.data + t.done, n, t.done)
+                                  : pread(t.fd, t.data + t.done, n, t.done);
+        if (count < 0 && errno == EINTR){
+            continue;
+        }
+        if (count < 0 || (count == 0 && t.writing)){
+            t.failed = true;
+            break;
+        }
+        if (count == 0){
+            t.size = t.done;
+            break;
+        }
+        t.done += count;
+    }
+    t.busy = false;
+}
@@ -3,129 +3,324 @@
  * Author: Zeyu Yang
  * Last Modified: 02/28/2021
  */
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <vector>
-#include <string>
-using namespace std;
-
-struct DefList{
-    int defCount;
-    vector<string> definition;
-    vector<int> relAddress;
-};
-
-struct UList{
-    int useCount;
-    vector<string> usedSym;
-};
-
-struct ProList{
-    int codeCount;
-    vector<string> type;
-    vector<string> instr;
-};
-
-void tokenizer(char* input[]);
-bool parseToken();
-bool parseDefinition(DefList& dl);
-bool parseUse(UList& ul);
-bool parseProgram(ProList& pl);
-bool isNum(string tokenItem);
-bool isSym(string tokenItem);
-bool isIEAR(string tokenItem);
-int turnToInt(string num);
-void getSymbolTable(vector<DefList>& fDefList, vector<ProList>& fProList);
-string trim(string& str);
-bool symDuplicate(string symbol);
-void symTooBig(vector<DefList>& fDefList, vector<ProList>& fProList);
-void getMemoryMap(vector<UList>& fUList, vector<ProList>& fProList);
-void printSymNotInUse(vector<DefList>& fDefList, vector<UList>& fUList);
-string turnToString(int num);
-string turnAllZero(string instr);
-string addZero(string instr);
-
-vector<int> rowNum;
-vector<int> offset;
-vector<string> token;
-int finalPositionX;
-int finalPositionY;
-int tokenPointer;
-vector<DefList> fileDefList;
-vector<UList> fileUList;
-vector<ProList> fileProList;
-int num_instr = 0;
-vector<string> tableSym;
-vector<int> tableValue;
-int finalLineLength = 0;
-
-int main(int argc, char* argv[]) {
+#include "linker.h"
+#include <thread>
+#include <algorithm>
+
+const DigitTable digitTable;
+
+/* Fewest instructions worth handing to a relocation thread */
+const int minRelocChunk = 4096;
+
+Linker::Linker(int outFd): inputData(NULL), inputSize(0), inputMapped(false), out(outFd), relocThreads(1), stats(NULL), helperAllocs(0), cache(NULL), gcSections(false), streaming(false), pipelined(false), pipe(NULL), parseThreads(1){
+    reset();
+}
+
+Linker::~Linker(){
+    releaseInput();
+    for (int i = 0; i < chunkOut.size(); i++) {
+        delete chunkOut[i];
+    }
+    for (int i = 0; i < parseWorkers.size(); i++) {
+        delete parseWorkers[i];
+    }
+}
+
+/* Forget the previous job, keeping the memory already allocated */
+void Linker::reset(){
+    releaseInput();
+    token.clear();
+    finalPositionX = 0;
+    finalPositionY = 0;
+    finalLineLength = 0;
+    objectInput = false;
+    tokenPointer = 0;
+    num_instr = 0;
+    droppedTokens = 0;
+    splitInput = false;
+    inputName = NULL;
+    inputBytes = 0;
+    scanPos = NULL;
+    scanLine = NULL;
+    scanTrimEnd = NULL;
+    scanNext = NULL;
+    scanRow = 0;
+    moduleStart.clear();
+    xref.clear();
+    moduleHash.clear();
+    program.clear();
+    symbolTable.clear();
+    arena.reset();
+}
+
+/* Link one input file, writing the result to the output buffer
+ * Return false if the input has a parse error
+ */
+bool Linker::link(const char* path){
+    if (stats != NULL){
+        stats->begin(path, out.produced());
+    }
     /*     Pass One    */
-    tokenizer(argv);
-    if (parseToken()){/* If input is parsed successfully */
+    tokenizer(path);
+    return linkInput();
+}
+
+/* Link an input the caller has read into memory and keeps until the
+ * link returns. data is NULL if the input could not be read
+ */
+bool Linker::link(const char* path, char* data, size_t size){
+    if (stats != NULL){
+        stats->begin(path, out.produced());
+    }
+    if (data == NULL){
+        openError();
+    } else{
+        inputData = data;
+        inputSize = size;
+        inputMapped = false;
+        startInput();
+    }
+    return linkInput();
+}
+
+/* Parse the input taken by tokenizer and go on with the link */
+bool Linker::linkInput(){
+    phaseDone(PHASE_TOKENIZER);
+    bool parsed = objectInput ? loadObject() : parseToken();
+    stopPipe();
+    return finishLink(parsed);
+}
+
+/* Link several input files as one stream of modules, in the order given
+ * Files are read and parsed together, so with --stats the tokenizer
+ * phase covers both
+ */
+bool Linker::link(const vector<string>& paths){
+    if (paths.size() == 1){
+        return link(paths[0].c_str());
+    }
+    if (stats != NULL){
+        stats->begin(paths[0].c_str(), out.produced());
+    }
+    bool parsed = parseFiles(paths);
+    phaseDone(PHASE_TOKENIZER);
+    return finishLink(parsed);
+}
+
+/* Everything after the input is parsed: archive members, pass two and
+ * the figures of the link
+ */
+bool Linker::finishLink(bool parsed){
+    if (parsed && !archives.empty()){
+        parsed = linkArchives();
+    }
+    if (parsed && gcSections){
+        parsed = collectModules();
+    }
+    if (parsed){
+        xref.build(program, symbolTable.entries.size(), false);
+    }
+    phaseDone(PHASE_PARSE);
+    if (parsed){/* If input is parsed successfully */
         /*     Pass Two    */
-        symTooBig(fileDefList, fileProList);
-        getSymbolTable(fileDefList, fileProList);
-        getMemoryMap(fileUList, fileProList);
-        printf("\n");
-        printSymNotInUse(fileDefList, fileUList);
-    }
-}
-
-/* Read input file */
-void tokenizer(char* input[]){
-    ifstream infile (input[1], ios::binary);
-    if (infile.is_open()) {
-        int row = 0;
-        string line;
-        int rowLength;
-        while (getline(infile,line)){
-            string lineTrim = line;
-            if (trim(lineTrim) != ""){
-                line = trim(line);
-                finalLineLength = line.length();
-            }else{
-                finalLineLength = line.length();
-                line = trim(line);
-            }
-            row++;
-            rowLength = line.length();
-            int pointer = 0;
-            for (int k = 0; k < rowLength; k++) {
-                if (line.substr(k, 1) != " " && line.substr(k, 1) != "\t"){
-                    pointer = k;
-                    break;
-                }
-            }
-            for (int i = pointer; i < rowLength; i++){
-                //cout << "i: " << i << endl;
-                string tokenChar = line.substr(i, 1);
-                string tokenValue;
-                if (i < rowLength-1){
-                    string tokenCharNext = line.substr(i+1, 1);
-                    if ((tokenChar == " " || tokenChar == "\t") && (tokenCharNext != " " && tokenCharNext != "\t")){
-                        tokenValue = line.substr(pointer, i-pointer);
-                        rowNum.push_back(row);
-                        offset.push_back(i-tokenValue.length()+1);
-                        tokenValue = trim(tokenValue);
-                        token.push_back(tokenValue);
-                        pointer = i+1;
-                    }
-                } else{
-                    tokenValue = line.substr(pointer, i-pointer+1);
-                    rowNum.push_back(row);
-                    offset.push_back(i-tokenValue.length()+2);
-                    token.push_back(tokenValue);
-                }
-            }
+        symTooBig(program);
+        phaseDone(PHASE_SYM_TOO_BIG);
+        if (imageFile.empty()){
+            getSymbolTable(program);
+            phaseDone(PHASE_SYMBOL_TABLE);
+            getMemoryMap(program);
+            out.putChar('\n');
+        } else{
+            defineSymbols(program);
+            phaseDone(PHASE_SYMBOL_TABLE);
+            writeImage(program);
         }
+        phaseDone(PHASE_MEMORY_MAP);
+        printSymNotInUse(program);
+    }
+    releaseInput();
+    out.flush();
+    phaseDone(PHASE_NOT_IN_USE);
+    if (stats != NULL){
+        stats->tokens = token.size() + droppedTokens;
+        stats->modules = program.moduleCount();
+        stats->symbols = symbolTable.entries.size();
+        stats->instructions = program.moduleBase.back();
+        stats->bytesWritten = out.produced() - stats->bytesWritten;
+    }
+    return parsed;
+}
 
-        finalPositionX = row;
-        finalPositionY = finalLineLength + 1;
-        infile.close();
-    } else {
-        cout << "Fail to open file." << endl;
+/* Close the current phase of the --stats timing */
+void Linker::phaseDone(Phase phase){
+    heapAllocs += helperAllocs.exchange(0);
+    if (stats == NULL){
+        return;
+    }
+    if (phase == PHASE_TOKENIZER){
+        stats->bytesRead = inputSize + inputBytes;
+    }
+    stats->lap(phase);
+}
+
+/* Read input file
+ * The file is memory-mapped and split into tokens in place, each token
+ * records its row, column and a pointer/length into the mapped buffer.
+ * When streaming, tokens are only scanned as the parser asks for them,
+ * a pipelined link scans them on a thread of its own.
+ * An object file is only mapped, loadObject takes it from there.
+ * Return false if the file cannot be read
+ */
+bool Linker::tokenizer(const char* path){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0){
+            close(fd);
+        }
+        openError();
+        return false;
+    }
+    inputSize = st.st_size;
+    if (inputSize > 0){
+        void* mapped = mmap(NULL, inputSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED){
+            close(fd);
+            inputSize = 0;
+            openError();
+            return false;
+        }
+        inputData = (char*)mapped;
+        inputMapped = true;
+        madvise(inputData, inputSize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    startInput();
+    return true;
+}
+
+/* Set up scanning of the input in inputData: an object file is left to
+ * loadObject, a text input is tokenized or handed to the tokenizer
+ * thread
+ */
+void Linker::startInput(){
+    if (inputSize >= sizeof(objMagic) && memcmp(inputData, objMagic, sizeof(objMagic)) == 0){
+        objectInput = true;
+        return;
+    }
+
+    scanPos = inputData;
+    scanTrimEnd = inputData;
+    scanNext = inputData;
+    scanRow = 0;
+    if (pipelined){
+        pipe = new TokenPipe;
+        producer = helper([this]{ produceTokens(); });
+    } else if (!streaming && !tokenizeParallel()){
+        scanAll();
+    }
+}
+
+/* Make line p, numbered row, the one being scanned */
+void Linker::startLine(const char* p, int row){
+    const char* end = inputData + inputSize;
+    const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+    if (lineEnd == NULL){
+        lineEnd = end;
+    }
+    /* Trailing blanks are not part of the line, unless it is blank */
+    const char* trimEnd = lineEnd;
+    while (trimEnd > p && (trimEnd[-1] == ' ' || trimEnd[-1] == '\t')){
+        trimEnd--;
+    }
+    if (trimEnd != p){
+        finalLineLength = trimEnd - p;
+    } else{
+        finalLineLength = lineEnd - p;
+    }
+    scanLine = p;
+    scanPos = p;
+    scanTrimEnd = trimEnd;
+    scanNext = lineEnd < end ? lineEnd + 1 : end;
+    scanRow = row;
+}
+
+/* Append the next token of the input, false at the end of the input,
+ * where the final position is known
+ */
+bool Linker::scanToken(){
+    const char* end = inputData + inputSize;
+    while (true) {
+        while (scanPos < scanTrimEnd && (*scanPos == ' ' || *scanPos == '\t')){
+            scanPos++;
+        }
+        if (scanPos < scanTrimEnd){
+            break;
+        }
+        if (scanNext >= end){
+            finalPositionX = scanRow;
+            finalPositionY = finalLineLength + 1;
+            return false;
+        }
+        startLine(scanNext, scanRow + 1);
+    }
+    Token t;
+    t.text = scanPos;
+    t.row = scanRow;
+    t.col = scanPos - scanLine + 1;
+    while (scanPos < scanTrimEnd && *scanPos != ' ' && *scanPos != '\t'){
+        scanPos++;
+    }
+    t.length = scanPos - t.text;
+    t.numeric = allDigits(t.text, t.length);
+    token.push_back(t);
+    return true;
+}
+
+/* Scan, or wait for the tokenizer thread, until there are n tokens,
+ * false if the input has fewer. Once the whole input is scanned this is
+ * only a size check
+ */
+bool Linker::fillTokens(size_t n){
+    if (pipe != NULL){
+        while (token.size() < n && pipe->pop(token)) {
+        }
+        return token.size() >= n;
+    }
+    while (token.size() < n && scanToken()) {
+    }
+    return token.size() >= n;
+}
+
+/* Scan again from a token found earlier */
+void Linker::seekToken(const Token& start){
+    startLine(start.text - (start.col - 1), start.row);
+    scanPos = start.text;
+}
+
+/* Stop the tokenizer thread of a pipelined link, which may still be
+ * running when the parser stopped at an error
+ */
+void Linker::stopPipe(){
+    if (pipe != NULL){
+        pipe->stop();
+        producer.join();
+        delete pipe;
+        pipe = NULL;
+    }
+}
+
+/* Unmap the input file once all tokens are consumed, an input read by
+ * the caller is only forgotten
+ */
+void Linker::releaseInput(){
+    stopPipe();
+    if (inputData != NULL){
+        if (inputMapped){
+            munmap(inputData, inputSize);
+        }
+        inputData = NULL;
+        inputSize = 0;
     }
 }
 
@@ -133,91 +328,152 @@ void tokenizer(char* input[]){
  * Identify definition list, use list and program list of each module
  * Report parse error if exists
  */
-bool parseToken(){
-    int totalToken = token.size();
-    while (tokenPointer < totalToken){
-        DefList dl;
-        UList ul;
-        ProList pl;
-        if (parseDefinition(dl)){
-            fileDefList.push_back(dl);
-        } else{
-            return false;
+bool Linker::parseToken(){
+    if (streaming){
+        return streamModules();
+    }
+    if (splitInput){
+        return parseParallel();
+    }
+    while (fillTokens(tokenPointer + 1)){
+        if (cache != NULL && reuseModule()){
+            continue;
         }
-        if (parseUse(ul)){
-            fileUList.push_back(ul);
-        } else{
+        int first = tokenPointer;
+        if (!parseModule(program)){
             return false;
         }
-        if (tokenPointer >= totalToken){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "NUM_EXPECTED");
-            return false;
+        if (cache != NULL){
+            cacheModule(first);
         }
-        if (parseProgram(pl)){
-            fileProList.push_back(pl);
-        } else{
+    }
+    return true;
+}
+
+/* Parse the module starting at tokenPointer into ir */
+bool Linker::parseModule(ModuleIR& ir){
+    if (parseDefinition(ir)){
+        ir.defBase.push_back(ir.defSym.size());
+    } else{
+        return false;
+    }
+    if (!fillTokens(tokenPointer + 1)){
+        parseError(finalPositionX, finalPositionY, "NUM_EXPECTED");
+        return false;
+    }
+    if (parseUse(ir)){
+        ir.useBase.push_back(ir.useSym.size());
+    } else{
+        return false;
+    }
+    if (!fillTokens(tokenPointer + 1)){
+        parseError(finalPositionX, finalPositionY, "NUM_EXPECTED");
+        return false;
+    }
+    if (parseProgram(ir)){
+        ir.moduleBase.push_back(ir.word.size());
+    } else{
+        return false;
+    }
+    return true;
+}
+
+/* Streaming pass one: parse one module at a time, keeping only its
+ * definitions, its size, its first token and which symbols its uselist
+ * names. Tokens are dropped once their module is parsed, so memory
+ * grows with the largest module and the symbol table, not the input,
+ * and reading stops at the first parse error
+ */
+bool Linker::streamModules(){
+    while (fillTokens(tokenPointer + 1)) {
+        ModuleIR& ir = streamModule;
+        ir.clear();
+        moduleStart.push_back(token[tokenPointer]);
+        if (!parseModule(ir)){
             return false;
         }
+        for (int k = 0; k < ir.defSym.size(); k++) {
+            program.defSym.push_back(ir.defSym[k]);
+            program.defRel.push_back(ir.defRel[k]);
+        }
+        program.defBase.push_back(program.defSym.size());
+        program.useBase.push_back(0);
+        program.moduleBase.push_back(program.moduleBase.back() + ir.word.size());
+        xref.build(ir, symbolTable.entries.size(), false);
+        droppedTokens += tokenPointer;
+        token.erase(token.begin(), token.begin() + tokenPointer);
+        tokenPointer = 0;
     }
     return true;
 }
 
+/* Streaming pass two: scan and parse each module again and relocate it
+ * straight into the output
+ */
+void Linker::relocateStream(){
+    ModuleIR& ir = streamModule;
+    int* usedStamp = arena.allocZero<int>(symbolTable.entries.size());
+    for (int i = 0; i < program.moduleCount(); i++) {
+        token.clear();
+        tokenPointer = 0;
+        seekToken(moduleStart[i]);
+        ir.clear();
+        num_instr = program.moduleBase[i];
+        if (!fillTokens(1) || !parseModule(ir)){
+            return;
+        }
+        relocateModule(ir, 0, i, program.moduleBase[i], out, usedStamp);
+    }
+    token.clear();
+}
+
 /* Parse definition list */
-bool parseDefinition(DefList& dl){
+bool Linker::parseDefinition(ModuleIR& ir){
     int defCount = 0;
     if (!isNum(token[tokenPointer])) {
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
     } else{
         defCount = turnToInt(token[tokenPointer]);
     }
     if (defCount < 0){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
-    } else if (defCount > 16){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "TOO_MANY_DEF_IN_MODULE");
+    } else if (defCount > config.maxDefs){
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "TOO_MANY_DEF_IN_MODULE");
         return false;
     } else if (defCount == 0) {
-        dl.defCount = defCount;
         tokenPointer = tokenPointer + 1;
         return true;
     } else {
         int defLength = tokenPointer + defCount*2 + 1;
+        fillTokens(defLength);
         if (defLength > token.size() && isNum(token.back())){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "SYM_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "SYM_EXPECTED");
             return false;
         }
         if (defLength > token.size() && isSym(token.back())){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "NUM_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "NUM_EXPECTED");
             return false;
         }
-        dl.defCount = defCount;
         for (int i = 0; i < defCount*2; i++) {
             if (i % 2 == 0 && !isSym(token[tokenPointer+i+1])){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "SYM_EXPECTED");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "SYM_EXPECTED");
                 return false;
-            } else if (i % 2 == 0 && isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length() <= 16) {
-                dl.definition.push_back(token[tokenPointer + i + 1]);
-            } else if (i % 2 == 0 && isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length() > 16){
+            } else if (i % 2 == 0 && isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length <= 16) {
+                const Token& sym = token[tokenPointer + i + 1];
+                ir.defSym.push_back(symbolTable.intern(sym.text, sym.length));
+            } else if (i % 2 == 0 && isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length > 16){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "SYM_TOO_LONG");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "SYM_TOO_LONG");
                 return false;
             } else if (i % 2 != 0 && !isNum(token[tokenPointer+i+1])){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
                 return false;
             } else {
-                dl.relAddress.push_back(turnToInt(token[tokenPointer+i+1]));
+                ir.defRel.push_back(turnToInt(token[tokenPointer+i+1]));
             }
         }
         tokenPointer = tokenPointer + defCount*2 + 1;
@@ -226,48 +482,42 @@ bool parseDefinition(DefList& dl){
 }
 
 /* Parse use list */
-bool parseUse(UList& ul){
+bool Linker::parseUse(ModuleIR& ir){
     int useCount = 0;
     if (!isNum(token[tokenPointer])) {
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
     } else{
         useCount = turnToInt(token[tokenPointer]);
     }
     if (useCount < 0){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
-    }else if (useCount > 16){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "TOO_MANY_USE_IN_MODULE");
+    }else if (useCount > config.maxUses){
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "TOO_MANY_USE_IN_MODULE");
         return false;
     } else if (useCount == 0) {
-        ul.useCount = useCount;
         tokenPointer = tokenPointer + 1;
         return true;
     } else{
         int useLength = tokenPointer + useCount + 1;
+        fillTokens(useLength);
         if (useLength > token.size()){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "SYM_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "SYM_EXPECTED");
             return false;
         }
-        ul.useCount = useCount;
         for (int i = 0; i < useCount; i++) {
             if (!isSym(token[tokenPointer+i+1])){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "SYM_EXPECTED");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "SYM_EXPECTED");
                 return false;
-            } else if (isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length() > 16){
+            } else if (isSym(token[tokenPointer+i+1]) && token[tokenPointer+i+1].length > 16){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "SYM_TOO_LONG");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "SYM_TOO_LONG");
                 return false;
             } else{
-                ul.usedSym.push_back(token[tokenPointer + i + 1]);
+                const Token& sym = token[tokenPointer + i + 1];
+                ir.useSym.push_back(symbolTable.intern(sym.text, sym.length));
             }
         }
         tokenPointer = tokenPointer + useCount + 1;
@@ -276,61 +526,52 @@ bool parseUse(UList& ul){
 }
 
 /* Parse program list */
-bool parseProgram(ProList& pl){
+bool Linker::parseProgram(ModuleIR& ir){
     int codeCount = 0;
     if (!isNum(token[tokenPointer])) {
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
-    } else if ((num_instr + turnToInt(token[tokenPointer])) > 512){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "TOO_MANY_INSTR");
+    } else if ((num_instr + (long long)turnToInt(token[tokenPointer])) > config.machineSize){
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "TOO_MANY_INSTR");
         return false;
     } else{
         num_instr = num_instr + turnToInt(token[tokenPointer]);
         codeCount = turnToInt(token[tokenPointer]);
     }
     if (codeCount < 0){
-        printf("Parse Error line %d offset %d: %s\n",
-               rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+        parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
         return false;
     } else if (codeCount == 0) {
         tokenPointer = tokenPointer + 1;
         return true;
     } else {
         int codeLength = tokenPointer + codeCount*2 + 1;
+        fillTokens(codeLength);
         if (codeLength > token.size() && isSym(token.back())){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "ADDR_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "ADDR_EXPECTED");
             return false;
         }
         if (codeLength > token.size() && isIEAR(token.back())){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "NUM_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "NUM_EXPECTED");
             return false;
         }
         if (codeLength > token.size() && isNum(token.back())){
-            printf("Parse Error line %d offset %d: %s\n",
-                   finalPositionX, finalPositionY, "ADDR_EXPECTED");
+            parseError(finalPositionX, finalPositionY, "ADDR_EXPECTED");
             return false;
         }
-        pl.codeCount = codeCount;
         for (int i = 0; i < codeCount*2; i++) {
             if (i % 2 == 0 && !isIEAR(token[tokenPointer+i+1])){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "ADDR_EXPECTED");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "ADDR_EXPECTED");
                 return false;
             } else if (i % 2 == 0 && isIEAR(token[tokenPointer+i+1])) {
-                pl.type.push_back(token[tokenPointer + i + 1]);
+                continue;
             } else if (i % 2 != 0 && !isNum(token[tokenPointer+i+1])){
                 tokenPointer = tokenPointer + i + 1;
-                printf("Parse Error line %d offset %d: %s\n",
-                       rowNum[tokenPointer], offset[tokenPointer], "NUM_EXPECTED");
+                parseError(token[tokenPointer].row, token[tokenPointer].col, "NUM_EXPECTED");
                 return false;
             } else {
-                string instruction = token[tokenPointer+i+1];
-                pl.instr.push_back(instruction);
+                decodeInstr(ir, token[tokenPointer+i], token[tokenPointer+i+1], config.wordWidth);
             }
         }
         tokenPointer = tokenPointer + codeCount*2 + 1;
@@ -338,296 +579,548 @@ bool parseProgram(ProList& pl){
     return true;
 }
 
-/* Generate symbol Table after pass 1 */
-void getSymbolTable(vector<DefList>& fDefList, vector<ProList>& fProList){
-    int exist = 0;
-    cout << "Symbol Table" <<endl;
-    for (int i = 0; i < fDefList.size(); i++) {
-        for (int k = 0; k < fDefList[i].definition.size(); k++) {
-            string variable = fDefList[i].definition[k];
-            int value = fDefList[i].relAddress[k];
-            for (int j = 0; j < i; j++) {
-                int baseAddress = fProList[j].codeCount;
-                value = value + baseAddress;
-            }
-            if (symDuplicate(variable) && exist == 0){
-                cout << variable << "=" << value << " " <<
-                "Error: This variable is multiple times defined; first value used" << endl;
-                tableSym.push_back(variable);
-                tableValue.push_back(value);
-                exist++;
-            } else if (!symDuplicate(variable)){
-                cout << variable << "=" << value << endl;
-                tableSym.push_back(variable);
-                tableValue.push_back(value);
-            }
-        }
+/* Decode one instruction into the module arrays */
+void decodeInstr(ModuleIR& ir, const Token& typeToken, const Token& wordToken, int wordWidth){
+    switch (typeToken.text[0]) {
+        case 'I': ir.type.push_back(TYPE_I); break;
+        case 'A': ir.type.push_back(TYPE_A); break;
+        case 'R': ir.type.push_back(TYPE_R); break;
+        default: ir.type.push_back(TYPE_E); break;
     }
+    const char* w = wordToken.text;
+    int length = wordToken.length;
+    int operand = 0;
+    for (int k = 1; k < length && k < wordWidth; k++) {
+        operand = operand*10 + (w[k] - '0');
+    }
+    ir.digits.push_back(length < 255 ? length : 255);
+    ir.opcode.push_back(w[0] - '0');
+    ir.operand.push_back(operand);
+    ir.word.push_back(turnToInt(wordToken));
 }
 
-/* Generate memory map */
-void getMemoryMap(vector<UList>& fUList, vector<ProList>& fProList){
-    cout << "\nMemory Map" <<endl;
-    int stepNum = 999;
-    for (int i = 0; i < fProList.size(); i++) {
-        vector<string> usedSymbols;
-        for (int j = 0; j < fProList[i].type.size(); j++) {
-            string type = fProList[i].type[j];
-            stepNum = stepNum + 1;
-            string sn = turnToString(stepNum);
-            string snDisplay = sn.substr(1,3);
-            string is1 = "0";
-            string is = fProList[i].instr[j].substr(1, 3);
-            for (int k = 0; k < is.length(); k++) {
-                string num = is.substr(k, 1);
-                if (num != "0"){
-                    is1 = is.substr(k);
-                    break;
-                }
-            }
-            int useNum = turnToInt(is1);
-            if (type == "I") {
-                if (turnToInt(fProList[i].instr[j]) >= 10000){
-                    cout << snDisplay << ": 9999 " << "Error: Illegal immediate value; treated as 9999" << endl;
-                } else{
-                    cout << snDisplay << ": " << addZero(turnAllZero(fProList[i].instr[j])) << endl;
-                }
-            }else if (type == "A"){
-                if (fProList[i].instr[j].length() >= 5){
-                    cout << snDisplay << ": 9999 " << "Error: Illegal opcode; treated as 9999" << endl;
-                } else{
-                    if (useNum > 512){
-                        int addressChanged = turnToInt(fProList[i].instr[j].substr(0, 1))*1000;
-                        string acToString = addZero(turnAllZero(turnToString(addressChanged)));
-                        cout << snDisplay << ": " << acToString <<
-                             " Error: Absolute address exceeds machine size; zero used" << endl;
-                    } else{
-                        cout << snDisplay << ": " << addZero(fProList[i].instr[j]) << endl;
-                    }
-                }
-            } else if (type == "R"){
-                if (fProList[i].instr[j].length() >= 5){
-                    cout << snDisplay << ": 9999 " << "Error: Illegal opcode; treated as 9999" << endl;
-                } else{
-                    int base = 0;
-                    for (int k = 0; k < i; k++) {
-                        base = base + fProList[k].codeCount;
-                    }
-                    if (useNum > fProList[i].codeCount){
-                        int addressChanged = turnToInt(fProList[i].instr[j].substr(0, 1))*1000;
-                        int address = addressChanged + base;
-                        string adToString = addZero(turnAllZero(turnToString(address)));
-                        cout << snDisplay << ": " << adToString <<
-                             " Error: Relative address exceeds module size; zero used" << endl;
-                    } else{
-                        int address = turnToInt(fProList[i].instr[j]) + base;
-                        string adToString = addZero(turnAllZero(turnToString(address)));
-                        cout << snDisplay << ": " << adToString << endl;
-                    }
-                }
-            } else if (type == "E"){
-                int address;
-                if (useNum >= fUList[i].usedSym.size()){
-                    cout << snDisplay << ": " << addZero(turnAllZero(fProList[i].instr[j])) <<
-                    " Error: External address exceeds length of uselist; treated as immediate" << endl;
-                } else{
-                    string sym = fUList[i].usedSym[useNum];
-                    int value = 0;
-                    bool symExist = false;
-                    for (int k = 0; k < tableSym.size(); k++) {
-                        if (tableSym[k] == sym){
-                            value = tableValue[k];
-                            symExist = true;
-                            break;
-                        }
-                    }
-                    address = turnToInt(fProList[i].instr[j].substr(0, 1))*1000 + value;
-                    string adToString = addZero(turnAllZero(turnToString(address)));
-                    if (symExist){
-                        cout << snDisplay << ": " << adToString << endl;
-                        usedSymbols.push_back(sym);
-                    } else{
-                        cout << snDisplay << ": " << adToString << " Error: "
-                        << sym <<" is not defined; zero used" << endl;
-                        usedSymbols.push_back(sym);
-                    }
-                }
+/* Give every defined symbol its absolute value
+ * A symbol defined again keeps its first value and is flagged
+ */
+void Linker::defineSymbols(ModuleIR& ir){
+    for (int i = 0; i < ir.moduleCount(); i++) {
+        for (int k = ir.defBase[i]; k < ir.defBase[i+1]; k++) {
+            SymEntry& entry = symbolTable.entries[ir.defSym[k]];
+            if (entry.defined){
+                entry.duplicate = true;
+            } else{
+                entry.defined = true;
+                entry.value = ir.defRel[k] + ir.moduleBase[i];
+                symbolTable.definedOrder.push_back(ir.defSym[k]);
             }
         }
-        for (int m = 0; m < fUList[i].usedSym.size(); m++) {
-            bool exist = false;
-            for (int n = 0; n < usedSymbols.size(); n++) {
-                if (usedSymbols[n] == fUList[i].usedSym[m]){
-                    exist = true;
-                    break;
-                }
-            }
-            if (!exist){
-                cout << "Warning: Module " << i+1 << ": " << fUList[i].usedSym[m]
-                << " appeared in the uselist but was not actually used" << endl;
-            }
+    }
+}
+
+/* Generate symbol Table after pass 1
+ * The table is printed once it is complete so the flag of a symbol
+ * defined again shows on the first entry
+ */
+void Linker::getSymbolTable(ModuleIR& ir){
+    out.put("Symbol Table\n");
+    defineSymbols(ir);
+    for (int i = 0; i < symbolTable.definedOrder.size(); i++) {
+        int sym = symbolTable.definedOrder[i];
+        putSym(out, sym);
+        out.putChar('=');
+        out.putInt(symbolTable.entries[sym].value);
+        if (symbolTable.entries[sym].duplicate){
+            out.put(" Error: This variable is multiple times defined; first value used");
         }
+        out.putChar('\n');
     }
 }
 
-/* Check if there is a symbol defined more then once */
-bool symDuplicate(string symbol){
-    bool erase = false;
-    int exist = 0;
-    for (int i = 0; i < fileDefList.size(); i++) {
-        int position = 0;
-        if (fileDefList[i].defCount != 0){
-            for (vector<string>::iterator it = fileDefList[i].definition.begin(); it != fileDefList[i].definition.end();) {
-                if (symbol == *it && exist == 0){
-                    exist++;
-                } else if (symbol == *it && exist > 0){
-                    erase = true;
-                }
-                ++it;
-                position++;
-            }
+/* Generate memory map
+ * With several relocation threads the modules are cut into contiguous
+ * ranges of about the same number of instructions, each range is
+ * relocated into its own buffer and the buffers are written in order
+ */
+void Linker::getMemoryMap(ModuleIR& ir){
+    out.put("\nMemory Map\n");
+    out.wordWidth = config.wordWidth;
+    out.labelWidth = config.labelWidth;
+    if (cache != NULL){
+        relocateCached(ir);
+        return;
+    }
+    if (streaming){
+        relocateStream();
+        return;
+    }
+    relocateAll(ir, NULL);
+}
+
+/* Relocate every module into the output, as memory map text or, when
+ * image is not NULL, as words stored in image with only the errors
+ * written out
+ */
+void Linker::relocateAll(const ModuleIR& ir, int* image){
+    int modules = ir.moduleCount();
+    int total = ir.moduleBase[modules];
+    int chunks = min(relocThreads, total / minRelocChunk + 1);
+    chunks = min(chunks, modules);
+    size_t symbols = symbolTable.entries.size();
+    if (chunks <= 1){
+        relocate(ir, 0, modules, out, arena.allocZero<int>(symbols), image);
+        return;
+    }
+    int* usedStamp = arena.allocZero<int>(symbols * chunks);
+    while (chunkOut.size() < chunks) {
+        chunkOut.push_back(new OutBuf(-1));
+    }
+    for (int k = 0; k < chunks; k++) {
+        chunkOut[k]->wordWidth = config.wordWidth;
+        chunkOut[k]->labelWidth = config.labelWidth;
+    }
+    int* cut = arena.alloc<int>(chunks + 1);
+    cut[0] = 0;
+    cut[chunks] = modules;
+    for (int k = 1; k < chunks; k++) {
+        long long target = (long long)total * k / chunks;
+        cut[k] = lower_bound(ir.moduleBase.begin() + cut[k-1], ir.moduleBase.begin() + modules, target)
+                 - ir.moduleBase.begin();
+    }
+    vector<thread> workers;
+    workers.reserve(chunks);
+    for (int k = 1; k < chunks; k++) {
+        chunkOut[k]->clear();
+        OutBuf* buf = chunkOut[k];
+        int* stamp = usedStamp + symbols * k;
+        workers.push_back(helper([this, &ir, cut, k, buf, stamp, image]{
+            relocate(ir, cut[k], cut[k+1], *buf, stamp, image);
+        }));
+    }
+    relocate(ir, cut[0], cut[1], out, usedStamp, image);
+    for (int k = 1; k < chunks; k++) {
+        workers[k-1].join();
+        out.append(*chunkOut[k]);
+    }
+}
+
+/* Relocate modules [first, last) into buf, usedStamp is a zeroed array
+ * with an entry per symbol for this range alone
+ * Only the symbol table is shared and it is read-only here
+ */
+void Linker::relocate(const ModuleIR& ir, int first, int last, OutBuf& buf, int* usedStamp, int* image) const{
+    for (int i = first; i < last; i++) {
+        relocateModule(ir, i, i, ir.moduleBase[i], buf, usedStamp, image);
+    }
+}
+
+/* The text a memory map line gets for a relocation error */
+void Linker::putRelocError(OutBuf& buf, RelocError error, int sym) const{
+    switch (error) {
+    case RELOC_IMMEDIATE:
+        buf.put(" Error: Illegal immediate value; treated as ");
+        buf.putWord(config.wordLimit() - 1);
+        break;
+    case RELOC_OPCODE:
+        buf.put(" Error: Illegal opcode; treated as ");
+        buf.putWord(config.wordLimit() - 1);
+        break;
+    case RELOC_ABSOLUTE:
+        buf.put(" Error: Absolute address exceeds machine size; zero used");
+        break;
+    case RELOC_RELATIVE:
+        buf.put(" Error: Relative address exceeds module size; zero used");
+        break;
+    case RELOC_USELIST:
+        buf.put(" Error: External address exceeds length of uselist; treated as immediate");
+        break;
+    case RELOC_UNDEFINED:
+        buf.put(" Error: ");
+        putSym(buf, sym);
+        buf.put(" is not defined; zero used");
+        break;
+    default:
+        break;
+    }
+}
+
+SymKey SymbolTable::makeKey(const char* name, int length){
+    SymKey key;
+    key.w[0] = 0;
+    key.w[1] = 0;
+    memcpy(key.w, name, length);
+    return key;
+}
+
+unsigned long long SymbolTable::hash(const SymKey& key){
+    unsigned long long h = key.w[0] * 0x9E3779B97F4A7C15ULL;
+    h ^= (key.w[1] + (h >> 29)) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 32);
+}
+
+/* Return the slot holding the key, or the empty slot where it belongs */
+int SymbolTable::probe(const SymKey& key) const{
+    unsigned long long pos = hash(key) & mask;
+    while (slots[pos] >= 0) {
+        const SymKey& other = entries[slots[pos]].key;
+        if (other.w[0] == key.w[0] && other.w[1] == key.w[1]){
+            break;
         }
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+/* Return the entry index of a symbol, -1 if it is not in the table */
+int SymbolTable::find(const char* name, int length) const{
+    if (slots.empty() || length > 16){
+        return -1;
     }
-    return erase;
+    return slots[probe(makeKey(name, length))];
 }
 
-/* Print warning if there is a symbol address too big */
-void symTooBig(vector<DefList>& fDefList, vector<ProList>& fProList){
-    vector<string> symChecked;
+/* Return the id of a symbol, adding it to the table if it is new */
+int SymbolTable::intern(const char* name, int length){
+    if ((entries.size() + 1) * 2 > slots.size()){
+        grow();
+    }
+    SymKey key = makeKey(name, length);
+    int pos = probe(key);
+    if (slots[pos] >= 0){
+        return slots[pos];
+    }
+    SymEntry entry;
+    entry.key = key;
+    entry.length = length;
+    entry.value = 0;
+    entry.defined = false;
+    entry.duplicate = false;
+    int id = entries.size();
+    slots[pos] = id;
+    entries.push_back(entry);
+    return id;
+}
+
+/* Double the slot array, keeping the load factor at or below one half */
+void SymbolTable::grow(){
+    size_t capacity = slots.empty() ? 64 : slots.size() * 2;
+    slots.assign(capacity, -1);
+    mask = capacity - 1;
+    for (int i = 0; i < entries.size(); i++) {
+        slots[probe(entries[i].key)] = i;
+    }
+}
+
+void SymbolTable::clear(){
+    entries.clear();
+    slots.clear();
+    definedOrder.clear();
+    mask = 0;
+}
+
+void ModuleIR::clear(){
+    defBase.assign(1, 0);
+    defSym.clear();
+    defRel.clear();
+    useBase.assign(1, 0);
+    useSym.clear();
+    moduleBase.assign(1, 0);
+    type.clear();
+    digits.clear();
+    opcode.clear();
+    operand.clear();
+    word.clear();
+}
+
+/* Print warning if there is a symbol address too big
+ * Only the first not yet checked definition of a module is examined,
+ * and checking stops for good at the first one seen twice
+ */
+void Linker::symTooBig(ModuleIR& ir){
+    bool* symChecked = arena.allocZero<bool>(symbolTable.entries.size());
     bool exist = false;
-    for (int i = 0; i < fDefList.size(); i++) {
-        for (int j = 0; j < fDefList[i].definition.size(); j++) {
-            string sym = fDefList[i].definition[j];
-            for (int k = 0; k < symChecked.size(); k++) {
-                if (symChecked[k] == sym){
-                    exist = true;
-                    break;
-                }
-            }
-            if (!exist){
-                int address = fDefList[i].relAddress[j];
-                int codeCount = fProList[i].codeCount;
-                if (address >= codeCount){
-                    cout << "Warning: Module "<< i+1 <<": " << sym << " too big " << address <<
-                         " (max="<< codeCount-1 <<") assume zero relative" << endl;
-                    fDefList[i].relAddress[j] = 0;
-                }
-                symChecked.push_back(sym);
+    for (int i = 0; i < ir.moduleCount() && !exist; i++) {
+        for (int j = ir.defBase[i]; j < ir.defBase[i+1]; j++) {
+            int sym = ir.defSym[j];
+            if (symChecked[sym]){
+                exist = true;
                 break;
             }
+            int address = ir.defRel[j];
+            int codeCount = ir.moduleBase[i+1] - ir.moduleBase[i];
+            if (address >= codeCount){
+                out.put("Warning: Module ");
+                out.putInt(i+1);
+                out.put(": ");
+                putSym(out, sym);
+                out.put(" too big ");
+                out.putInt(address);
+                out.put(" (max=");
+                out.putInt(codeCount-1);
+                out.put(") assume zero relative\n");
+                ir.defRel[j] = 0;
+            }
+            symChecked[sym] = true;
+            break;
         }
     }
 }
 
 /* Print warning if there is symbol defined but not in use */
-void printSymNotInUse(vector<DefList>& fDefList, vector<UList>& fUList){
-    vector<string> symDefined;
-    vector<int> module;
-    vector<string> symInUse;
-    for (int i = 0; i < fDefList.size(); i++) {
-        for (int j = 0; j < fDefList[i].definition.size(); j++) {
-            symDefined.push_back(fDefList[i].definition[j]);
-            module.push_back(i);
-        }
-    }
-    for (int k = 0; k < fUList.size(); k++) {
-        for (int l = 0; l < fUList[k].usedSym.size(); l++) {
-            symInUse.push_back(fUList[k].usedSym[l]);
-        }
-    }
-    for (int i = 0; i < symDefined.size(); i++) {
-        bool symUsed = false;
-        for (int j = 0; j < symInUse.size(); j++) {
-            if (symDefined[i] == symInUse[j]){
-                symUsed = true;
-                break;
+void Linker::printSymNotInUse(ModuleIR& ir){
+    for (int i = 0; i < ir.moduleCount(); i++) {
+        for (int j = ir.defBase[i]; j < ir.defBase[i+1]; j++) {
+            int sym = ir.defSym[j];
+            if (!xref.referenced[sym]){
+                out.put("Warning: Module ");
+                out.putInt(i+1);
+                out.put(": ");
+                putSym(out, sym);
+                out.put(" was defined but never used\n");
             }
         }
-        if (!symUsed){
-            cout << "Warning: Module "<< module[i]+1 <<": "
-            << symDefined[i] <<" was defined but never used" << endl;
+    }
+    out.putChar('\n');
+}
+
+/* The scanner flags tokens made only of digits */
+bool isNum(const Token& tokenItem){
+    return tokenItem.numeric;
+}
+
+bool isSym(const Token& tokenItem){
+    return isalpha((unsigned char)tokenItem.text[0]);
+}
+
+bool isIEAR(const Token& tokenItem){
+    if (tokenItem.length != 1){
+        return false;
+    }
+    char tI = tokenItem.text[0];
+    return tI == 'I' || tI == 'E' || tI == 'A' || tI == 'R';
+}
+
+/* Read a digit token, saturating at INT_MAX like stream extraction does */
+int turnToInt(const Token& num){
+    long long x = 0;
+    for (int i = 0; i < num.length; i++) {
+        x = x*10 + (num.text[i] - '0');
+        if (x > INT_MAX){
+            return INT_MAX;
         }
     }
-    printf("\n");
+    return (int)x;
 }
 
-bool isNum(string tokenItem){
-    for (int i = 0; i < tokenItem.length(); i++) {
-        char tI = tokenItem[i];
-        if (!isdigit(tI)){
-            return false;
+void Linker::putSym(OutBuf& buf, int id) const{
+    buf.put(symbolTable.name(id), symbolTable.entries[id].length);
+}
+
+/* Errors name the file when the link has several */
+void Linker::parseError(int row, int col, const char* error){
+    out.put("Parse Error ");
+    if (inputName != NULL){
+        out.put("in ");
+        out.put(inputName);
+        out.putChar(' ');
+    }
+    out.put("line ");
+    out.putInt(row);
+    out.put(" offset ");
+    out.putInt(col);
+    out.put(": ");
+    out.put(error);
+    out.putChar('\n');
+}
+
+void Linker::openError(){
+    if (inputName == NULL){
+        out.put("Fail to open file.\n");
+        return;
+    }
+    out.put("Fail to open file ");
+    out.put(inputName);
+    out.put(".\n");
+}
+
+Arena::~Arena(){
+    reset();
+    delete[] block;
+}
+
+/* Start a new block, the current one is kept until reset */
+void Arena::grow(size_t bytes){
+    if (block != NULL){
+        retired.push_back(block);
+        spilled += used;
+    }
+    capacity = max(max(capacity * 2, bytes), (size_t)1 << 16);
+    block = new char[capacity];
+    used = 0;
+}
+
+/* Give back everything. When the last link needed several blocks they
+ * are replaced by one that holds all of it
+ */
+void Arena::reset(){
+    if (!retired.empty()){
+        for (int k = 0; k < retired.size(); k++) {
+            delete[] retired[k];
+        }
+        retired.clear();
+        size_t needed = spilled + used;
+        if (needed > capacity){
+            delete[] block;
+            capacity = needed;
+            block = new char[capacity];
         }
     }
-    return true;
+    spilled = 0;
+    used = 0;
 }
 
-bool isSym(string tokenItem){
-    char tI = tokenItem[0];
-    if (isalpha(tI)){
-        return true;
+bool MachineConfig::valid() const{
+    return machineSize > 0 && maxDefs >= 0 && maxUses >= 0
+           && machineSize <= 100000000
+           && wordWidth >= 2 && wordWidth <= 9 && labelWidth >= 1 && labelWidth <= 9;
+}
+
+int MachineConfig::power10(int n){
+    int p = 1;
+    while (n-- > 0) {
+        p *= 10;
     }
-    return false;
+    return p;
 }
 
-bool isIEAR(string tokenItem){
-    if (tokenItem.length() != 1){
-        return false;
-    } else if (tokenItem != "I" && tokenItem != "E" && tokenItem != "A" && tokenItem != "R"){
-        return false;
-    } else {
-        return true;
+DigitTable::DigitTable(){
+    for (int i = 0; i < 10000; i++) {
+        word[i][0] = '0' + i/1000;
+        word[i][1] = '0' + i/100%10;
+        word[i][2] = '0' + i/10%10;
+        word[i][3] = '0' + i%10;
     }
 }
 
-int turnToInt(string num){
-    int x;
-    stringstream ss;
-    ss << num;
-    ss >> x;
-    ss.clear();
-    return x;
+OutBuf::OutBuf(int outFd): used(0), capacity(1 << 20), fd(outFd), wordWidth(4), labelWidth(3), written(0){
+    data = new char[capacity];
 }
 
-string turnToString(int num){
-    stringstream st;
-    st<<num;
-    string str= st.str();
-    return str;
+OutBuf::~OutBuf(){
+    flush();
+    delete[] data;
 }
 
-string trim(string& str){
-    string strTrim;
-    strTrim = str.erase(str.find_last_not_of(" \t") + 1);
-    return strTrim;
+/* Write out what is buffered, or grow a memory-only buffer */
+void OutBuf::makeRoom(size_t n){
+    flush();
+    if (used + n > capacity){
+        size_t grown = max(capacity * 2, used + n);
+        char* bigger = new char[grown];
+        memcpy(bigger, data, used);
+        delete[] data;
+        data = bigger;
+        capacity = grown;
+    }
 }
 
-string turnAllZero(string instr){
-    bool allZero = true;
-    for (int j = 0; j < instr.length(); j++) {
-        if (instr.substr(j, 1) != "0"){
-            allZero = false;
-            break;
-        }
+/* Add the contents of another buffer, bypassing our own buffer
+ * when the data can go straight to the file
+ */
+void OutBuf::append(const OutBuf& other){
+    if (fd >= 0){
+        flush();
+        writeAll(other.data, other.used);
+    } else{
+        put(other.data, other.used);
+    }
+}
+
+void OutBuf::putInt(long long v){
+    char digits[24];
+    int n = 0;
+    bool negative = v < 0;
+    unsigned long long u = negative ? 0ULL - v : v;
+    do {
+        digits[n++] = '0' + u%10;
+        u /= 10;
+    } while (u != 0);
+    if (negative){
+        putChar('-');
+    }
+    if (used + n > capacity){
+        makeRoom(n);
+    }
+    while (n > 0) {
+        data[used++] = digits[--n];
     }
-    if (allZero){
-        return "0000";
+}
+
+/* Words are printed with at least wordWidth digits */
+void OutBuf::putWord(long long v){
+    if (wordWidth == 4 && v >= 0 && v < 10000){
+        put(digitTable.word[v], 4);
     } else{
-        return instr;
+        putPadded(v, wordWidth);
+    }
+}
+
+void OutBuf::putPadded(long long v, int width){
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v%10;
+        v /= 10;
+    } while (v != 0);
+    while (n < width) {
+        digits[n++] = '0';
+    }
+    if (used + n > capacity){
+        makeRoom(n);
+    }
+    while (n > 0) {
+        data[used++] = digits[--n];
     }
 }
 
-string addZero(string instr){
-    string instrAddZero = instr;
-    if (instr.length()!=4){
-        for (int i = 0; i < 4-instr.length(); i++) {
-            instrAddZero = "0" + instrAddZero;
+/* The label of an instruction is its index modulo 10^labelWidth */
+void OutBuf::putLabel(int index){
+    if (labelWidth == 3){
+        if (used + 3 > capacity){
+            makeRoom(3);
         }
-        return instrAddZero;
+        memcpy(data + used, digitTable.word[index % 1000] + 1, 3);
+        used += 3;
     } else{
-        return instr;
+        putPadded(index % MachineConfig::power10(labelWidth), labelWidth);
     }
 }
 
+/* "NNN: WWWW" */
+void OutBuf::putMapLine(int index, long long word){
+    putLabel(index);
+    put(": ", 2);
+    putWord(word);
+}
 
+void OutBuf::flush(){
+    if (fd < 0){
+        return;
+    }
+    writeAll(data, used);
+    used = 0;
+}
 
-
+void OutBuf::writeAll(const char* s, size_t n){
+    while (n > 0) {
+        ssize_t count = write(fd, s, n);
+        if (count < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        s += count;
+        n -= count;
+        written += count;
+    }
+}
@@ -0,0 +1,671 @@
+/* File: linker.h
+ * Program: two-pass linker
+ * Author: Zeyu Yang
+ */
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <climits>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+/* A token is a span into the mapped input file, no copy is made */
+struct Token{
+    const char* text;
+    int length;
+    int row;
+    int col;
+    bool numeric;
+};
+
+/* Symbol names are at most 16 characters, so a name is kept zero-padded
+ * in two machine words and compared without touching the heap
+ */
+struct SymKey{
+    unsigned long long w[2];
+};
+
+struct SymEntry{
+    SymKey key;
+    int length;
+    int value;
+    bool defined;
+    bool duplicate;
+};
+
+/* Open addressing hash table with linear probing. Every symbol named in
+ * a definition or a uselist gets an id, the position of its entry
+ */
+struct SymbolTable{
+    vector<SymEntry> entries;
+    vector<int> slots;
+    vector<int> definedOrder;
+    unsigned long long mask;
+
+    SymbolTable(): mask(0) {}
+    int find(const char* name, int length) const;
+    int intern(const char* name, int length);
+    const char* name(int id) const { return (const char*)entries[id].key.w; }
+    void clear();
+private:
+    static SymKey makeKey(const char* name, int length);
+    static unsigned long long hash(const SymKey& key);
+    int probe(const SymKey& key) const;
+    void grow();
+};
+
+/* Size of the target machine and limits on the input. The defaults are
+ * the 512-word machine with 4-digit words and 3-digit memory map labels.
+ * Words are kept in an int, so they can be at most 9 digits wide.
+ */
+struct MachineConfig{
+    int machineSize;
+    int maxDefs;
+    int maxUses;
+    int wordWidth;
+    int labelWidth;
+
+    MachineConfig(): machineSize(512), maxDefs(16), maxUses(16), wordWidth(4), labelWidth(3) {}
+    int wordLimit() const { return power10(wordWidth); }
+    int opcodeScale() const { return power10(wordWidth - 1); }
+    bool valid() const;
+    static int power10(int n);
+};
+
+/* "0000" to "9999", the last three digits double as memory map labels */
+struct DigitTable{
+    char word[10000][4];
+    DigitTable();
+};
+
+extern const DigitTable digitTable;
+
+/* Output is formatted into one large buffer and handed to write(2) in
+ * big chunks instead of being flushed line by line. A buffer without a
+ * file descriptor (fd < 0) just grows and keeps everything in memory.
+ */
+struct OutBuf{
+    char* data;
+    size_t used;
+    size_t capacity;
+    int fd;
+    int wordWidth;
+    int labelWidth;
+    unsigned long long written;
+
+    OutBuf(int outFd);
+    ~OutBuf();
+    void put(const char* s, size_t n){
+        if (used + n > capacity){
+            makeRoom(n);
+        }
+        memcpy(data + used, s, n);
+        used += n;
+    }
+    void put(const char* s){ put(s, strlen(s)); }
+    void putChar(char c){
+        if (used == capacity){
+            makeRoom(1);
+        }
+        data[used++] = c;
+    }
+    void putInt(long long v);
+    void putWord(long long v);
+    void putPadded(long long v, int width);
+    void putLabel(int index);
+    void putMapLine(int index, long long word);
+    void append(const OutBuf& other);
+    void clear(){ used = 0; }
+    /* Bytes written out or still held, all of them for a buffer without fd */
+    unsigned long long produced() const { return written + used; }
+    void swapData(OutBuf& other){
+        swap(data, other.data);
+        swap(used, other.used);
+        swap(capacity, other.capacity);
+    }
+    void flush();
+private:
+    OutBuf(const OutBuf&);
+    OutBuf& operator=(const OutBuf&);
+    void makeRoom(size_t n);
+    void writeAll(const char* s, size_t n);
+};
+
+/* Bump allocator for the scratch arrays of one link. Arrays are carved
+ * out of large blocks and all given back at once by reset(), which keeps
+ * one block big enough for everything the last link took, so a Linker
+ * reused for many jobs stops calling the heap after the first. Only
+ * arrays of plain types are allocated, nothing is destroyed
+ */
+struct Arena{
+    char* block;
+    size_t used;
+    size_t capacity;
+    size_t spilled;
+    vector<char*> retired;
+
+    Arena(): block(NULL), used(0), capacity(0), spilled(0) {}
+    ~Arena();
+    template<typename T>
+    T* alloc(size_t n){
+        size_t bytes = (n * sizeof(T) + 15) & ~(size_t)15;
+        if (used + bytes > capacity){
+            grow(bytes);
+        }
+        T* p = (T*)(block + used);
+        used += bytes;
+        return p;
+    }
+    template<typename T>
+    T* allocZero(size_t n){
+        T* p = alloc<T>(n);
+        memset(p, 0, n * sizeof(T));
+        return p;
+    }
+    void reset();
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+    void grow(size_t bytes);
+};
+
+enum InstrType{ TYPE_I, TYPE_A, TYPE_R, TYPE_E };
+
+/* What went wrong relocating one instruction */
+enum RelocError{
+    RELOC_NONE, RELOC_IMMEDIATE, RELOC_OPCODE, RELOC_ABSOLUTE, RELOC_RELATIVE,
+    RELOC_USELIST, RELOC_UNDEFINED
+};
+
+/* All modules of the input, decoded once during pass one.
+ * Module i owns definitions [defBase[i], defBase[i+1]), uselist entries
+ * [useBase[i], useBase[i+1]) and instructions [moduleBase[i], moduleBase[i+1]),
+ * so moduleBase[i] is also the base address of module i.
+ * Symbols are stored as symbol table ids, instructions as the word value
+ * with its opcode (first digit) and operand (the remaining digits of the
+ * word width) split out.
+ */
+struct ModuleIR{
+    vector<int> defBase;
+    vector<int> defSym;
+    vector<int> defRel;
+    vector<int> useBase;
+    vector<int> useSym;
+    vector<int> moduleBase;
+    vector<unsigned char> type;
+    vector<unsigned char> digits;
+    vector<unsigned char> opcode;
+    vector<int> operand;
+    vector<int> word;
+
+    ModuleIR() { clear(); }
+    int moduleCount() const { return moduleBase.size() - 1; }
+    void clear();
+};
+
+enum Phase{
+    PHASE_TOKENIZER, PHASE_PARSE, PHASE_SYM_TOO_BIG, PHASE_SYMBOL_TABLE,
+    PHASE_MEMORY_MAP, PHASE_NOT_IN_USE, PHASE_COUNT
+};
+
+/* Heap allocations made by the current thread, counted by the global
+ * operator new in stats.cpp
+ */
+extern thread_local unsigned long long heapAllocs;
+
+/* Timing and size figures of one link, collected with --stats */
+struct LinkStats{
+    string input;
+    double seconds[PHASE_COUNT];
+    unsigned long long allocs[PHASE_COUNT];
+    long long tokens;
+    long long modules;
+    long long symbols;
+    long long instructions;
+    long long removedModules;
+    long long removedWords;
+    long long bytesRead;
+    long long bytesWritten;
+    long peakRssKb;
+    double lapStart;
+    unsigned long long lapAllocs;
+
+    void begin(const char* path, unsigned long long writtenBefore);
+    void lap(Phase phase);
+    void report(FILE* file) const;
+    string json() const;
+    static double now();
+    static const char* phaseName(int phase);
+};
+
+/* A record of the cache file. It points into the mapped file, or into
+ * a string made during this link for records that were not found
+ */
+struct CacheRecord{
+    const char* data;
+    size_t size;
+    bool kept;
+};
+
+/* Persistent cache for incremental relinking (--cache).
+ * Module records are keyed by a hash of the module's tokens and hold its
+ * parsed lists. Memory map segments are keyed by the module, its number,
+ * its base address and the values of the symbols in its uselist, and
+ * hold the text pass two printed for it. Only the records used by the
+ * last link are written back, so the file follows the input.
+ */
+struct LinkCache{
+    string path;
+    MachineConfig config;
+    char* mapped;
+    size_t mappedSize;
+    unordered_map<unsigned long long, CacheRecord> modules;
+    unordered_map<unsigned long long, CacheRecord> segments;
+    deque<string> fresh;
+
+    LinkCache(): mapped(NULL), mappedSize(0) {}
+    ~LinkCache();
+    void load(const char* cachePath, const MachineConfig& linkConfig);
+    bool save();
+    const CacheRecord* find(unordered_map<unsigned long long, CacheRecord>& table, unsigned long long key);
+    void add(unordered_map<unsigned long long, CacheRecord>& table, unsigned long long key, const char* data, size_t size);
+    static unsigned long long hashTokens(const Token* first, int count);
+    static unsigned long long mix(unsigned long long h, unsigned long long v);
+private:
+    LinkCache(const LinkCache&);
+    LinkCache& operator=(const LinkCache&);
+    bool readRecords(const char*& p, const char* end, unsigned count,
+                     unordered_map<unsigned long long, CacheRecord>& table);
+    void release();
+};
+
+/* Header of a binary object file, made by --emit-object from a text
+ * input that parsed without error. It is followed by the module arrays
+ * in the layout of ModuleIR:
+ *   ObjSymbol symbols[symbolCount]      symbol table in id order
+ *   int defBase[moduleCount+1], defSym[defCount], defRel[defCount]
+ *   int useBase[moduleCount+1], useSym[useCount]
+ *   int moduleBase[moduleCount+1]
+ *   int word[instrCount]
+ *   ObjWide wide[wideCount]             words not wordWidth digits long
+ *   unsigned char type[instrCount]
+ * A word of wordWidth digits gives its opcode and operand back by
+ * division, only the others keep them. The limits it was parsed with
+ * are kept, the operands depend on them
+ */
+struct ObjHeader{
+    char magic[8];
+    int machineSize;
+    int maxDefs;
+    int maxUses;
+    int wordWidth;
+    int moduleCount;
+    int symbolCount;
+    int defCount;
+    int useCount;
+    int instrCount;
+    int wideCount;
+};
+
+struct ObjSymbol{
+    char name[16];
+    int length;
+};
+
+/* Decoded fields of a word with fewer or more digits than wordWidth */
+struct ObjWide{
+    int index;
+    int digits;
+    int opcode;
+    int operand;
+};
+
+extern const char objMagic[8];
+
+/* Header of a module archive, made by --make-archive. It is followed by
+ *   ArcIndexEntry index[indexCount]     defined symbols sorted by name
+ *   unsigned long long offset[moduleCount+1]
+ *   module records, record m is bytes [offset[m], offset[m+1])
+ * Records are encoded like the module records of the cache, with symbol
+ * names, so they can be added to any link. A symbol defined by several
+ * modules is indexed to the first.
+ */
+struct ArcHeader{
+    char magic[8];
+    int maxDefs;
+    int maxUses;
+    int wordWidth;
+    int moduleCount;
+    int indexCount;
+    int reserved;
+};
+
+struct ArcIndexEntry{
+    char name[16];
+    int length;
+    int module;
+};
+
+extern const char arcMagic[8];
+
+/* Header of an executable image, written by --image in place of the
+ * memory map text. It is followed by
+ *   int moduleBase[moduleCount+1]       moduleBase[moduleCount] == wordCount
+ *   ImgSymbol symbols[symbolCount]      defined symbols in symbol table order
+ *   int words[wordCount]                the relocated words by address
+ * in host byte order, every part four-byte aligned so the file can be
+ * mapped and used in place
+ */
+struct ImgHeader{
+    char magic[8];
+    int wordWidth;
+    int moduleCount;
+    int symbolCount;
+    int wordCount;
+};
+
+struct ImgSymbol{
+    char name[16];
+    int length;
+    int value;
+};
+
+extern const char imgMagic[8];
+
+/* A mapped archive */
+struct Archive{
+    char* data;
+    size_t size;
+    ArcHeader header;
+    const ArcIndexEntry* index;
+    const unsigned long long* offset;
+    const char* records;
+
+    Archive(): data(NULL), size(0), index(NULL), offset(NULL), records(NULL) {}
+    ~Archive();
+    const char* open(const char* path, const MachineConfig& config);
+    int find(const char* name, int length) const;
+    CacheRecord member(int module) const;
+private:
+    Archive(const Archive&);
+    Archive& operator=(const Archive&);
+};
+
+/* Cross-reference index of a link. referenced[s] is set when symbol s
+ * is in some uselist. The lists are only made for the --xref report:
+ * symbol s is defined by modules defModule[defBase[s], defBase[s+1])
+ * and named in the uselists of modules refModule[refBase[s], refBase[s+1])
+ */
+struct XrefIndex{
+    vector<bool> referenced;
+    vector<int> defBase;
+    vector<int> defModule;
+    vector<int> refBase;
+    vector<int> refModule;
+
+    void build(const ModuleIR& ir, int symbols, bool lists);
+    void clear();
+};
+
+/* Batches of tokens between the tokenizer thread and the parser of a
+ * pipelined link: a single-producer single-consumer ring of slots.
+ * The producer fills slot tail % pipeSlots and moves tail on, the
+ * consumer takes slot head % pipeSlots and moves head on. The two
+ * counters sit on cache lines of their own
+ */
+const unsigned pipeSlots = 8;
+
+struct TokenPipe{
+    vector<Token> slot[pipeSlots];
+    alignas(64) atomic<unsigned> head;
+    alignas(64) atomic<unsigned> tail;
+    atomic<bool> done;
+    atomic<bool> stopped;
+
+    TokenPipe();
+    vector<Token>* reserve();
+    void publish();
+    void close();
+    bool pop(vector<Token>& tokens);
+    void stop();
+};
+
+/* A whole-file transfer: size bytes read from fd at offset zero into
+ * data, or written from data. A read of a file that turns out shorter
+ * ends early with size cut to what was read
+ */
+struct IoTransfer{
+    int fd;
+    char* data;
+    size_t size;
+    size_t done;
+    bool writing;
+    bool busy;
+    bool failed;
+
+    IoTransfer(): fd(-1), data(NULL), size(0), done(0), writing(false), busy(false), failed(false) {}
+};
+
+/* Queue of file transfers on an io_uring, so reads and writes go on
+ * while the thread computes. Without a ring (setup not called, or the
+ * kernel refused it) every transfer is done on the spot with pread or
+ * pwrite. A queue belongs to one thread and holds at most ringEntries
+ * transfers at a time
+ */
+const unsigned ringEntries = 8;
+
+struct IoQueue{
+    int ringFd;
+    char* sqRing;
+    char* cqRing;
+    void* sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    void* cqes;
+
+    IoQueue();
+    ~IoQueue();
+    bool setup();
+    void start(IoTransfer& t);
+    void wait(IoTransfer& t);
+private:
+    IoQueue(const IoQueue&);
+    IoQueue& operator=(const IoQueue&);
+    void queue(IoTransfer& t);
+    bool reap();
+    void complete(IoTransfer& t, int result);
+    void transferNow(IoTransfer& t);
+    void release();
+};
+
+enum IoMode{ IO_URING, IO_PREAD, IO_MMAP };
+
+/* State of one link job. Each job owns its tokens, module arrays, symbol
+ * table and output buffer, so several jobs can run side by side, and a
+ * Linker can be reset and reused without giving its memory back
+ */
+struct Linker{
+    vector<Token> token;
+    char* inputData;
+    size_t inputSize;
+    bool inputMapped;
+    const char* scanPos;
+    const char* scanLine;
+    const char* scanTrimEnd;
+    const char* scanNext;
+    int scanRow;
+    int finalPositionX;
+    int finalPositionY;
+    int finalLineLength;
+    int tokenPointer;
+    int num_instr;
+    MachineConfig config;
+    ModuleIR program;
+    SymbolTable symbolTable;
+    XrefIndex xref;
+    OutBuf out;
+    Arena arena;
+    int relocThreads;
+    vector<OutBuf*> chunkOut;
+    LinkStats* stats;
+    atomic<unsigned long long> helperAllocs;
+    LinkCache* cache;
+    vector<unsigned long long> moduleHash;
+    bool objectInput;
+    vector<string> archives;
+    string imageFile;
+    bool gcSections;
+    vector<int> gcRoots;
+    string entry;
+    bool streaming;
+    bool pipelined;
+    TokenPipe* pipe;
+    thread producer;
+    ModuleIR streamModule;
+    vector<Token> moduleStart;
+    long long droppedTokens;
+    int parseThreads;
+    bool splitInput;
+    vector<vector<Token> > chunkTokens;
+    vector<int> chunkRows;
+    vector<long long> walkFirst;
+    vector<int> walkAddress;
+    vector<Linker*> parseWorkers;
+    const char* inputName;
+    long long inputBytes;
+
+    Linker(int outFd);
+    ~Linker();
+    bool link(const char* path);
+    bool link(const vector<string>& paths);
+    bool link(const char* path, char* data, size_t size);
+    bool linkInput();
+    bool finishLink(bool parsed);
+    void reset();
+
+    bool tokenizer(const char* path);
+    void startInput();
+    void startLine(const char* p, int row);
+    bool scanToken();
+    void scanAll();
+    void scanEnd(const char* line, int row);
+    void produceTokens();
+    void stopPipe();
+    bool tokenizeParallel();
+    bool parseParallel();
+    void joinParts(int parts);
+    bool parseFile(const char* path);
+    bool parseFiles(const vector<string>& paths);
+    bool fillTokens(size_t n);
+    void seekToken(const Token& start);
+    void releaseInput();
+    bool loadObject();
+    bool parseOnly(const char* inputPath);
+    bool emitObject(const char* inputPath, const char* objectPath);
+    bool makeArchive(const char* inputPath, const char* archivePath);
+    bool linkArchives();
+    bool markLive(const ModuleIR& ir, bool* live);
+    bool collectModules();
+    bool parseToken();
+    bool parseModule(ModuleIR& ir);
+    bool streamModules();
+    bool reuseModule();
+    bool loadModule(const CacheRecord& record, int codeCount);
+    void cacheModule(int first);
+    void moduleRecord(int i, string& record) const;
+    void hashModules(const ModuleIR& ir, int first);
+    bool parseDefinition(ModuleIR& ir);
+    bool parseUse(ModuleIR& ir);
+    bool parseProgram(ModuleIR& ir);
+    void parseError(int row, int col, const char* error);
+    void openError();
+    void defineSymbols(ModuleIR& ir);
+    void getSymbolTable(ModuleIR& ir);
+    void symTooBig(ModuleIR& ir);
+    void getMemoryMap(ModuleIR& ir);
+    void relocateAll(const ModuleIR& ir, int* image);
+    void relocate(const ModuleIR& ir, int first, int last, OutBuf& buf, int* usedStamp, int* image) const;
+    void relocateModule(const ModuleIR& ir, int i, int number, int base, OutBuf& buf, int* usedStamp,
+                        int* image = NULL) const;
+    void putRelocError(OutBuf& buf, RelocError error, int sym) const;
+    void writeImage(const ModuleIR& ir);
+    void relocateStream();
+    void relocateCached(const ModuleIR& ir);
+    void printSymNotInUse(ModuleIR& ir);
+    void putXref(OutBuf& buf);
+    bool writeXref(const char* path);
+    void putSym(OutBuf& buf, int id) const;
+    void phaseDone(Phase phase);
+
+    /* Start a thread that works for this link. Its heap allocations
+     * are added to the link's when the current phase ends
+     */
+    template<typename F>
+    thread helper(F f){
+        return thread([this, f]{
+            f();
+            helperAllocs += heapAllocs;
+        });
+    }
+};
+
+/* Options shared by every link of one invocation */
+struct LinkSettings{
+    int relocThreads;
+    int parseThreads;
+    MachineConfig config;
+    bool streaming;
+    bool pipelined;
+    bool stats;
+    string statsFile;
+    string cacheFile;
+    string objectFile;
+    string archiveFile;
+    string xrefFile;
+    string imageFile;
+    vector<string> archives;
+    bool gcSections;
+    vector<int> gcRoots;
+    string entry;
+    IoMode ioMode;
+
+    LinkSettings(): relocThreads(1), parseThreads(1), streaming(false), pipelined(false), stats(false), gcSections(false),
+                    ioMode(IO_URING) {}
+    void apply(Linker& linker) const;
+    void setStats(const char* target);
+    void emitStats(const LinkStats& linkStats) const;
+};
+
+int runServer(const char* path, int threads, const LinkSettings& settings);
+
+void decodeInstr(ModuleIR& ir, const Token& typeToken, const Token& wordToken, int wordWidth);
+bool allDigits(const char* s, int n);
+int scanChunk(const char* from, const char* to, vector<Token>& out);
+bool isNum(const Token& tokenItem);
+bool isSym(const Token& tokenItem);
+bool isIEAR(const Token& tokenItem);
+int turnToInt(const Token& num);
+void referencedSymbols(const ModuleIR& ir, int i, vector<int>& refs);
+bool writeFile(const char* path, const string& image);
+
+#endif
@@ -0,0 +1,483 @@
+/* File: main.cpp
+ * Program: two-pass linker
+ * Usage: linker [options] <input>... | @<response file>
+ *        linker --batch [-j <jobs>] [-m <manifest>] [options] [<input> <output>]...
+ *        linker --serve <socket>|- [-j <threads>] [options]
+ */
+#include "linker.h"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+struct BatchJob{
+    string input;
+    string output;
+};
+
+bool readManifest(const char* path, vector<BatchJob>& jobs);
+bool readResponse(const char* path, vector<string>& inputs);
+int runBatch(const vector<BatchJob>& jobs, int threads, const LinkSettings& settings);
+void batchWorker(const vector<BatchJob>* jobs, const LinkSettings* settings, atomic<int>* next, atomic<int>* failed);
+void queuedBatchWorker(const vector<BatchJob>* jobs, const LinkSettings* settings, atomic<int>* next, atomic<int>* failed);
+void usage();
+
+int main(int argc, char* argv[]) {
+    bool batch = false;
+    const char* servePath = NULL;
+    vector<BatchJob> jobs;
+    int threads = thread::hardware_concurrency();
+    LinkSettings settings;
+    const char* statsEnv = getenv("LINKER_STATS");
+    if (statsEnv != NULL && statsEnv[0] != '\0'){
+        settings.setStats(statsEnv);
+    }
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0){
+            batch = true;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            servePath = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+            settings.relocThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--parse-threads") == 0 && i + 1 < argc){
+            settings.parseThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0){
+            settings.pipelined = true;
+        } else if (strcmp(argv[i], "--stream") == 0){
+            settings.streaming = true;
+        } else if (strcmp(argv[i], "--stats") == 0){
+            settings.setStats("1");
+        } else if (strncmp(argv[i], "--stats=", 8) == 0){
+            settings.setStats(argv[i] + 8);
+        } else if (strcmp(argv[i], "--machine-size") == 0 && i + 1 < argc){
+            settings.config.machineSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-defs") == 0 && i + 1 < argc){
+            settings.config.maxDefs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-uses") == 0 && i + 1 < argc){
+            settings.config.maxUses = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--word-width") == 0 && i + 1 < argc){
+            settings.config.wordWidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--label-width") == 0 && i + 1 < argc){
+            settings.config.labelWidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc){
+            settings.cacheFile = argv[++i];
+        } else if (strcmp(argv[i], "--emit-object") == 0 && i + 1 < argc){
+            settings.objectFile = argv[++i];
+        } else if (strcmp(argv[i], "--make-archive") == 0 && i + 1 < argc){
+            settings.archiveFile = argv[++i];
+        } else if (strcmp(argv[i], "--xref") == 0 && i + 1 < argc){
+            settings.xrefFile = argv[++i];
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc){
+            settings.imageFile = argv[++i];
+        } else if (strcmp(argv[i], "--gc-sections") == 0){
+            settings.gcSections = true;
+        } else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc){
+            settings.gcSections = true;
+            settings.entry = argv[++i];
+        } else if (strcmp(argv[i], "--gc-root") == 0 && i + 1 < argc){
+            settings.gcSections = true;
+            settings.gcRoots.push_back(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+            settings.archives.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc){
+            i++;
+            if (strcmp(argv[i], "uring") == 0){
+                settings.ioMode = IO_URING;
+            } else if (strcmp(argv[i], "pread") == 0){
+                settings.ioMode = IO_PREAD;
+            } else if (strcmp(argv[i], "mmap") == 0){
+                settings.ioMode = IO_MMAP;
+            } else{
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc){
+            if (!readManifest(argv[++i], jobs)){
+                fprintf(stderr, "linker: cannot read manifest %s\n", argv[i]);
+                return 1;
+            }
+        } else{
+            break;
+        }
+    }
+    if (!settings.config.valid()){
+        fprintf(stderr, "linker: invalid machine configuration\n");
+        return 1;
+    }
+    if (settings.streaming && (!settings.cacheFile.empty() || !settings.objectFile.empty()
+                               || !settings.archiveFile.empty() || !settings.archives.empty()
+                               || !settings.xrefFile.empty() || !settings.imageFile.empty() || settings.gcSections)){
+        fprintf(stderr, "linker: --stream cannot be used with --cache, --emit-object, --make-archive, -l, --xref, --image or --gc-sections\n");
+        return 1;
+    }
+    if (settings.pipelined && !settings.cacheFile.empty()){
+        fprintf(stderr, "linker: --pipeline cannot be used with --cache\n");
+        return 1;
+    }
+    if ((!settings.imageFile.empty() || settings.gcSections) && !settings.cacheFile.empty()){
+        fprintf(stderr, "linker: --image and --gc-sections cannot be used with --cache\n");
+        return 1;
+    }
+    if ((batch || servePath != NULL)
+        && (!settings.cacheFile.empty() || !settings.objectFile.empty() || !settings.archiveFile.empty()
+            || !settings.xrefFile.empty() || !settings.imageFile.empty())){
+        fprintf(stderr, "linker: --cache, --emit-object, --make-archive, --xref and --image cannot be used with --batch or --serve\n");
+        return 1;
+    }
+    if (servePath != NULL){
+        if (batch || i != argc){
+            usage();
+            return 1;
+        }
+        return runServer(servePath, threads, settings);
+    }
+    if (batch){
+        if ((argc - i) % 2 != 0){
+            usage();
+            return 1;
+        }
+        for (; i < argc; i += 2) {
+            BatchJob job;
+            job.input = argv[i];
+            job.output = argv[i+1];
+            jobs.push_back(job);
+        }
+        return runBatch(jobs, threads, settings) == 0 ? 0 : 1;
+    }
+    vector<string> inputs;
+    for (; i < argc; i++) {
+        if (argv[i][0] != '@'){
+            inputs.push_back(argv[i]);
+        } else if (!readResponse(argv[i] + 1, inputs)){
+            fprintf(stderr, "linker: cannot read response file %s\n", argv[i] + 1);
+            return 1;
+        }
+    }
+    if (inputs.empty()){
+        usage();
+        return 1;
+    }
+    if (inputs.size() > 1 && (settings.streaming || !settings.cacheFile.empty() || !settings.objectFile.empty()
+                              || !settings.archiveFile.empty())){
+        fprintf(stderr, "linker: --stream, --cache, --emit-object and --make-archive take a single input\n");
+        return 1;
+    }
+    Linker linker(STDOUT_FILENO);
+    LinkStats linkStats;
+    LinkCache cache;
+    settings.apply(linker);
+    if (!settings.objectFile.empty()){
+        if (!linker.emitObject(inputs[0].c_str(), settings.objectFile.c_str())){
+            fprintf(stderr, "linker: no object file written for %s\n", inputs[0].c_str());
+            return 1;
+        }
+        return 0;
+    }
+    if (!settings.archiveFile.empty()){
+        if (!linker.makeArchive(inputs[0].c_str(), settings.archiveFile.c_str())){
+            fprintf(stderr, "linker: no archive written for %s\n", inputs[0].c_str());
+            return 1;
+        }
+        return 0;
+    }
+    if (settings.stats){
+        linker.stats = &linkStats;
+    }
+    if (!settings.cacheFile.empty()){
+        cache.load(settings.cacheFile.c_str(), settings.config);
+        linker.cache = &cache;
+    }
+    bool parsed = linker.link(inputs);
+    if (parsed && !settings.xrefFile.empty() && !linker.writeXref(settings.xrefFile.c_str())){
+        fprintf(stderr, "linker: cannot write cross-reference file %s\n", settings.xrefFile.c_str());
+    }
+    if (linker.cache != NULL && !cache.save()){
+        fprintf(stderr, "linker: cannot write cache file %s\n", settings.cacheFile.c_str());
+    }
+    if (settings.stats){
+        settings.emitStats(linkStats);
+    }
+    return 0;
+}
+
+/* Manifest lines hold an input path and an output path,
+ * blank lines and lines starting with '#' are skipped
+ */
+bool readManifest(const char* path, vector<BatchJob>& jobs){
+    ifstream manifest(path);
+    if (!manifest.is_open()){
+        return false;
+    }
+    string line;
+    while (getline(manifest, line)){
+        istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.input) || job.input[0] == '#'){
+            continue;
+        }
+        if (!(fields >> job.output)){
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+/* A response file lists input paths separated by blanks or newlines,
+ * lines starting with '#' are skipped
+ */
+bool readResponse(const char* path, vector<string>& inputs){
+    ifstream response(path);
+    if (!response.is_open()){
+        return false;
+    }
+    string line;
+    while (getline(response, line)){
+        istringstream fields(line);
+        string input;
+        if (!(fields >> input) || input[0] == '#'){
+            continue;
+        }
+        do {
+            inputs.push_back(input);
+        } while (fields >> input);
+    }
+    return true;
+}
+
+/* Give a Linker the options of the command line */
+void LinkSettings::apply(Linker& linker) const{
+    linker.relocThreads = relocThreads;
+    linker.parseThreads = parseThreads;
+    linker.config = config;
+    linker.streaming = streaming;
+    linker.pipelined = pipelined;
+    linker.archives = archives;
+    linker.imageFile = imageFile;
+    linker.gcSections = gcSections;
+    linker.gcRoots = gcRoots;
+    linker.entry = entry;
+}
+
+/* "1" or "stderr" prints a table to stderr, anything else names a file
+ * that gets one JSON object per link appended to it
+ */
+void LinkSettings::setStats(const char* target){
+    stats = true;
+    if (strcmp(target, "1") == 0 || strcmp(target, "stderr") == 0){
+        statsFile.clear();
+    } else{
+        statsFile = target;
+    }
+}
+
+void LinkSettings::emitStats(const LinkStats& linkStats) const{
+    static mutex statsLock;
+    lock_guard<mutex> guard(statsLock);
+    if (statsFile.empty()){
+        linkStats.report(stderr);
+        return;
+    }
+    int fd = open(statsFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0){
+        fprintf(stderr, "linker: cannot open stats file %s\n", statsFile.c_str());
+        return;
+    }
+    string record = linkStats.json();
+    if (write(fd, record.data(), record.size()) != (ssize_t)record.size()){
+        fprintf(stderr, "linker: cannot write stats file %s\n", statsFile.c_str());
+    }
+    close(fd);
+}
+
+/* Link every job on a pool of threads, each thread reusing one Linker
+ * Return the number of jobs whose output could not be written
+ */
+int runBatch(const vector<BatchJob>& jobs, int threads, const LinkSettings& settings){
+    if (threads < 1){
+        threads = 1;
+    }
+    if (threads > jobs.size()){
+        threads = jobs.size();
+    }
+    atomic<int> next(0);
+    atomic<int> failed(0);
+    vector<thread> pool;
+    void (*worker)(const vector<BatchJob>*, const LinkSettings*, atomic<int>*, atomic<int>*);
+    worker = settings.ioMode == IO_MMAP ? batchWorker : queuedBatchWorker;
+    for (int i = 1; i < threads; i++) {
+        pool.push_back(thread(worker, &jobs, &settings, &next, &failed));
+    }
+    worker(&jobs, &settings, &next, &failed);
+    for (int i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+    return failed;
+}
+
+void batchWorker(const vector<BatchJob>* jobs, const LinkSettings* settings, atomic<int>* next, atomic<int>* failed){
+    Linker linker(-1);
+    LinkStats linkStats;
+    settings->apply(linker);
+    if (settings->stats){
+        linker.stats = &linkStats;
+    }
+    int i;
+    while ((i = next->fetch_add(1)) < (int)jobs->size()) {
+        const BatchJob& job = (*jobs)[i];
+        int fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0){
+            fprintf(stderr, "linker: cannot open output file %s\n", job.output.c_str());
+            (*failed)++;
+            continue;
+        }
+        linker.reset();
+        linker.out.fd = fd;
+        linker.link(job.input.c_str());
+        close(fd);
+        if (settings->stats){
+            settings->emitStats(linkStats);
+        }
+    }
+}
+
+/* Input of a batch job, read while the job before it is linked */
+struct BatchInput{
+    int job;
+    char* buffer;
+    size_t capacity;
+    IoTransfer read;
+
+    BatchInput(): job(-1), buffer(NULL), capacity(0) {}
+    ~BatchInput(){ delete[] buffer; }
+};
+
+/* Open the input of a job and start reading it, a job past the last is
+ * only noted. The buffer is kept from job to job and only grows
+ */
+static void readAhead(IoQueue& io, BatchInput& in, int job, const vector<BatchJob>& jobs){
+    in.job = job;
+    in.read.fd = -1;
+    in.read.failed = true;
+    if (job >= (int)jobs.size()){
+        return;
+    }
+    int fd = open(jobs[job].input.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0){
+        if (fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    size_t size = st.st_size;
+    if (size + 1 > in.capacity){
+        delete[] in.buffer;
+        in.capacity = size + 1;
+        in.buffer = new char[in.capacity];
+    }
+    in.read.fd = fd;
+    in.read.data = in.buffer;
+    in.read.size = size;
+    in.read.writing = false;
+    io.start(in.read);
+}
+
+/* Wait for the output of a job to be written and close it */
+static void finishWrite(IoQueue& io, IoTransfer& write, const BatchJob* job, atomic<int>* failed){
+    if (job == NULL){
+        return;
+    }
+    io.wait(write);
+    if (close(write.fd) != 0 || write.failed){
+        fprintf(stderr, "linker: cannot write output file %s\n", job->output.c_str());
+        (*failed)++;
+    }
+}
+
+/* Batch worker with queued I/O: while one job is linked the input of the
+ * next is read and the output of the one before is written. Outputs are
+ * made in memory, in two buffers taking turns, and written whole
+ */
+void queuedBatchWorker(const vector<BatchJob>* jobs, const LinkSettings* settings, atomic<int>* next, atomic<int>* failed){
+    Linker linker(-1);
+    OutBuf pending(-1);
+    LinkStats linkStats;
+    IoQueue io;
+    IoTransfer write;
+    const BatchJob* writing = NULL;
+    BatchInput input[2];
+    settings->apply(linker);
+    if (settings->stats){
+        linker.stats = &linkStats;
+    }
+    if (settings->ioMode == IO_URING){
+        io.setup();
+    }
+    int current = 0;
+    readAhead(io, input[current], next->fetch_add(1), *jobs);
+    while (input[current].job < (int)jobs->size()) {
+        BatchInput& in = input[current];
+        readAhead(io, input[1 - current], next->fetch_add(1), *jobs);
+        io.wait(in.read);
+        const BatchJob& job = (*jobs)[in.job];
+        linker.reset();
+        linker.out.clear();
+        linker.link(job.input.c_str(), in.read.failed ? NULL : in.read.data, in.read.size);
+        if (in.read.fd >= 0){
+            close(in.read.fd);
+        }
+        finishWrite(io, write, writing, failed);
+        writing = NULL;
+        pending.swapData(linker.out);
+        write.fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (write.fd < 0){
+            fprintf(stderr, "linker: cannot open output file %s\n", job.output.c_str());
+            (*failed)++;
+        } else{
+            write.data = pending.data;
+            write.size = pending.used;
+            write.writing = true;
+            io.start(write);
+            writing = &job;
+        }
+        if (settings->stats){
+            linkStats.bytesWritten = pending.used;
+            settings->emitStats(linkStats);
+        }
+        current = 1 - current;
+    }
+    finishWrite(io, write, writing, failed);
+}
+
+void usage(){
+    fprintf(stderr, "usage: linker [options] <input>... | @<response file>\n"
+            "       linker --batch [-j <jobs>] [-m <manifest>] [options] [<input> <output>]...\n"
+            "       linker --serve <socket>|- [-j <threads>] [options]\n"
+            "options:\n"
+            "  -t <threads>          relocate modules on this many threads\n"
+            "  --parse-threads <n>   tokenize and parse, or read several inputs, on this many threads\n"
+            "  --io uring|pread|mmap batch input and output: queued on an io_uring (the default),\n"
+            "                        read and written whole with pread/pwrite, or mapped as before\n"
+            "  --stream              keep only definitions in memory, scan modules again in pass two\n"
+            "  --pipeline            tokenize on a second thread while parsing\n"
+            "  --stats[=<file>]      report phase timings to stderr, or as JSON to <file>\n"
+            "  --cache <file>        reuse modules parsed and relocated by earlier links\n"
+            "  --emit-object <file>  write the parsed input to a binary object file, no link\n"
+            "  --make-archive <file> write the parsed input to a module archive, no link\n"
+            "  -l <archive>          link the archive modules the input needs\n"
+            "  --xref <file>         write which modules define and reference each symbol\n"
+            "  --image <file>        write the relocated program as a binary image, print only diagnostics\n"
+            "  --gc-sections         link only the modules reachable from the roots (module 1 by default)\n"
+            "  --entry <symbol>      make the module defining the symbol a root, implies --gc-sections\n"
+            "  --gc-root <n>         make module n a root, implies --gc-sections\n"
+            "  --machine-size <n>    words of memory (512)\n"
+            "  --max-defs <n>        definitions per module (16)\n"
+            "  --max-uses <n>        uselist entries per module (16)\n"
+            "  --word-width <n>      digits per word, 2 to 9 (4)\n"
+            "  --label-width <n>     digits per memory map label (3)\n");
+}
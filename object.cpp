@@ -0,0 +1,232 @@
+/* File: object.cpp
+ * Program: two-pass linker
+ * Binary object files: the parsed modules of a text input, written once
+ * with --emit-object and mapped by later links instead of being
+ * tokenized and parsed again
+ */
+#include "linker.h"
+
+const char objMagic[8] = {'\177', 'L', 'K', 'O', 'B', 'J', '2', '\n'};
+
+/* Append an array to the object image */
+template<typename T>
+static void putArray(string& image, const vector<T>& v){
+    if (!v.empty()){
+        image.append((const char*)&v[0], v.size() * sizeof(T));
+    }
+}
+
+/* Copy an array out of the mapped object, false if it runs past the end
+ * Pass two, --gc-sections and -l work on the ModuleIR vectors and change
+ * them in place, so the arrays cannot stay in the read-only mapping
+ */
+template<typename T>
+static bool getArray(const char*& p, const char* end, int count, vector<T>& v){
+    if (count < 0 || (size_t)(end - p) / sizeof(T) < (size_t)count){
+        return false;
+    }
+    v.assign((const T*)p, (const T*)p + count);
+    p += count * sizeof(T);
+    return true;
+}
+
+/* Every entry of a base array lies in [0, limit] and they never decrease */
+static bool basesValid(const vector<int>& base, int limit){
+    if (base.empty() || base[0] != 0 || base.back() != limit){
+        return false;
+    }
+    for (int i = 1; i < base.size(); i++) {
+        if (base[i] < base[i-1]){
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool idsValid(const vector<int>& ids, int symbolCount){
+    for (int i = 0; i < ids.size(); i++) {
+        if (ids[i] < 0 || ids[i] >= symbolCount){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rebuild digits, opcode and operand of every instruction from its word
+ * and the wide records, false if any of them is out of range
+ */
+static bool decodeWords(ModuleIR& ir, const char* wide, int wideCount, const MachineConfig& config){
+    int n = ir.word.size();
+    int wordLimit = config.wordLimit();
+    int opcodeScale = config.opcodeScale();
+    ir.digits.assign(n, config.wordWidth);
+    ir.opcode.resize(n);
+    ir.operand.resize(n);
+    for (int j = 0; j < n; j++) {
+        if (ir.type[j] > TYPE_E || ir.word[j] < 0){
+            return false;
+        }
+        ir.opcode[j] = ir.word[j] / opcodeScale;
+        ir.operand[j] = ir.word[j] % opcodeScale;
+    }
+    int last = -1;
+    for (int k = 0; k < wideCount; k++) {
+        ObjWide w;
+        memcpy(&w, wide + k * sizeof(ObjWide), sizeof(w));
+        if (w.index <= last || w.index >= n || w.digits < 1 || w.digits > 255
+            || w.digits == config.wordWidth || w.opcode < 0 || w.opcode > 9 || w.operand < 0){
+            return false;
+        }
+        ir.digits[w.index] = w.digits;
+        ir.opcode[w.index] = w.opcode;
+        ir.operand[w.index] = w.operand;
+        last = w.index;
+    }
+    for (int j = 0; j < n; j++) {
+        if (ir.digits[j] == config.wordWidth && ir.word[j] >= wordLimit){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Run pass one alone on a text input, for tools that store its modules
+ * A parse error is reported on the output as a normal link would
+ */
+bool Linker::parseOnly(const char* inputPath){
+    bool parsed = tokenizer(inputPath) && !objectInput && parseToken();
+    releaseInput();
+    out.flush();
+    return parsed;
+}
+
+/* Write a whole file, false if any part of it could not be written */
+bool writeFile(const char* path, const string& image){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return false;
+    }
+    const char* s = image.data();
+    size_t n = image.size();
+    while (n > 0) {
+        ssize_t count = write(fd, s, n);
+        if (count < 0 && errno == EINTR){
+            continue;
+        }
+        if (count <= 0){
+            close(fd);
+            return false;
+        }
+        s += count;
+        n -= count;
+    }
+    return close(fd) == 0;
+}
+
+/* Parse a text input and write its modules to an object file */
+bool Linker::emitObject(const char* inputPath, const char* objectPath){
+    if (!parseOnly(inputPath)){
+        return false;
+    }
+    ObjHeader header;
+    memcpy(header.magic, objMagic, sizeof(objMagic));
+    header.machineSize = config.machineSize;
+    header.maxDefs = config.maxDefs;
+    header.maxUses = config.maxUses;
+    header.wordWidth = config.wordWidth;
+    header.moduleCount = program.moduleCount();
+    header.symbolCount = symbolTable.entries.size();
+    header.defCount = program.defSym.size();
+    header.useCount = program.useSym.size();
+    header.instrCount = program.word.size();
+    vector<ObjWide> wide;
+    for (int j = 0; j < header.instrCount; j++) {
+        if (program.digits[j] != config.wordWidth){
+            ObjWide w = {j, program.digits[j], program.opcode[j], program.operand[j]};
+            wide.push_back(w);
+        }
+    }
+    header.wideCount = wide.size();
+
+    string image((const char*)&header, sizeof(header));
+    for (int id = 0; id < header.symbolCount; id++) {
+        ObjSymbol symbol;
+        memcpy(symbol.name, symbolTable.entries[id].key.w, sizeof(symbol.name));
+        symbol.length = symbolTable.entries[id].length;
+        image.append((const char*)&symbol, sizeof(symbol));
+    }
+    putArray(image, program.defBase);
+    putArray(image, program.defSym);
+    putArray(image, program.defRel);
+    putArray(image, program.useBase);
+    putArray(image, program.useSym);
+    putArray(image, program.moduleBase);
+    putArray(image, program.word);
+    putArray(image, wide);
+    putArray(image, program.type);
+    return writeFile(objectPath, image);
+}
+
+/* Take the modules of a mapped object file in place of pass one parsing
+ * The object was checked when it was written, here only its structure
+ * is checked so a damaged file cannot make pass two read out of bounds
+ */
+bool Linker::loadObject(){
+    ObjHeader header;
+    const char* p = inputData;
+    const char* end = inputData + inputSize;
+    if (inputSize < sizeof(header)){
+        out.put("Invalid object file.\n");
+        return false;
+    }
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (header.machineSize != config.machineSize || header.maxDefs != config.maxDefs
+        || header.maxUses != config.maxUses || header.wordWidth != config.wordWidth){
+        out.put("Object file was made for another machine configuration.\n");
+        return false;
+    }
+    bool valid = header.moduleCount >= 0 && header.symbolCount >= 0
+                 && header.instrCount >= 0 && header.instrCount <= config.machineSize
+                 && (size_t)(end - p) / sizeof(ObjSymbol) >= (size_t)header.symbolCount;
+    for (int id = 0; valid && id < header.symbolCount; id++) {
+        ObjSymbol symbol;
+        memcpy(&symbol, p, sizeof(symbol));
+        p += sizeof(symbol);
+        valid = symbol.length > 0 && symbol.length <= 16
+                && symbolTable.intern(symbol.name, symbol.length) == id;
+    }
+    ModuleIR& ir = program;
+    valid = valid && getArray(p, end, header.moduleCount + 1, ir.defBase)
+            && getArray(p, end, header.defCount, ir.defSym)
+            && getArray(p, end, header.defCount, ir.defRel)
+            && getArray(p, end, header.moduleCount + 1, ir.useBase)
+            && getArray(p, end, header.useCount, ir.useSym)
+            && getArray(p, end, header.moduleCount + 1, ir.moduleBase)
+            && getArray(p, end, header.instrCount, ir.word);
+    const char* wide = p;
+    valid = valid && header.wideCount >= 0 && header.wideCount <= header.instrCount
+            && (size_t)(end - p) / sizeof(ObjWide) >= (size_t)header.wideCount;
+    if (valid){
+        p += header.wideCount * sizeof(ObjWide);
+    }
+    valid = valid && getArray(p, end, header.instrCount, ir.type)
+            && p == end
+            && basesValid(ir.defBase, header.defCount)
+            && basesValid(ir.useBase, header.useCount)
+            && basesValid(ir.moduleBase, header.instrCount)
+            && idsValid(ir.defSym, header.symbolCount)
+            && idsValid(ir.useSym, header.symbolCount)
+            && decodeWords(ir, wide, header.wideCount, config);
+    if (!valid){
+        ir.clear();
+        symbolTable.clear();
+        out.put("Invalid object file.\n");
+        return false;
+    }
+    num_instr = header.instrCount;
+    if (cache != NULL){
+        hashModules(ir, 0);
+    }
+    return true;
+}
@@ -0,0 +1,383 @@
+/* File: parallel.cpp
+ * Program: two-pass linker
+ * Parallel pass one (--parse-threads)
+ *
+ * The input is cut at line starts into one chunk per thread and the
+ * chunks are tokenized side by side. A walk over the three counts of
+ * every module then finds where the modules start, and the modules are
+ * parsed in ranges of about the same number of tokens, each range by a
+ * worker with its own module arrays and symbol table. The ranges are
+ * stitched together in module order: symbols enter the symbol table in
+ * the order they first appear, so symbol ids, definition order and every
+ * diagnostic are those of the serial parse, and instruction addresses
+ * are prefix sums of the module sizes.
+ *
+ * A link of several input files is split the same way, by files: each
+ * thread reads and parses a run of consecutive files and the runs are
+ * stitched in command-line order.
+ */
+#include "linker.h"
+#include <thread>
+#include <algorithm>
+
+/* Smallest input worth splitting */
+const size_t minParallelInput = 1 << 20;
+
+/* Position of a token among the chunks */
+struct ChunkCursor{
+    int chunk;
+    long long index;
+};
+
+/* Tokenize the input on parseThreads threads into chunkTokens
+ * Return false if the input is not split, it is then scanned as usual
+ */
+bool Linker::tokenizeParallel(){
+    splitInput = false;
+    if (parseThreads <= 1 || inputSize < minParallelInput || cache != NULL){
+        return false;
+    }
+    int chunks = parseThreads;
+    const char* end = inputData + inputSize;
+    vector<const char*> cut(chunks + 1, end);
+    cut[0] = inputData;
+    for (int k = 1; k < chunks; k++) {
+        const char* p = max(cut[k-1], (const char*)inputData + inputSize / chunks * k);
+        const char* newline = p < end ? (const char*)memchr(p, '\n', end - p) : NULL;
+        cut[k] = newline == NULL ? end : newline + 1;
+    }
+    chunkTokens.resize(chunks);
+    chunkRows.assign(chunks + 1, 0);
+    vector<thread> workers;
+    for (int k = 0; k < chunks; k++) {
+        chunkTokens[k].clear();
+    }
+    for (int k = 1; k < chunks; k++) {
+        workers.push_back(helper([this, k, &cut]{ chunkRows[k+1] = scanChunk(cut[k], cut[k+1], chunkTokens[k]); }));
+    }
+    chunkRows[1] = scanChunk(cut[0], cut[1], chunkTokens[0]);
+    for (int k = 0; k < workers.size(); k++) {
+        workers[k].join();
+    }
+    /* chunkRows[k] becomes the number of rows before chunk k */
+    for (int k = 1; k <= chunks; k++) {
+        chunkRows[k] += chunkRows[k-1];
+    }
+    const char* lastLine = inputSize > 0 ? (const char*)memrchr(inputData, '\n', inputSize) : NULL;
+    scanEnd(lastLine == NULL ? inputData : lastLine + 1, chunkRows[chunks] + 1);
+    splitInput = true;
+    return true;
+}
+
+/* Parse the split input
+ * Anything the count walk cannot vouch for (a count that is not a
+ * number or over its limit, a module running past the input, too many
+ * instructions) sends the whole input to the serial parser, which
+ * reports the error exactly
+ */
+bool Linker::parseParallel(){
+    int chunks = chunkTokens.size();
+    long long* chunkFirst = arena.allocZero<long long>(chunks + 1);
+    for (int k = 0; k < chunks; k++) {
+        chunkFirst[k+1] = chunkFirst[k] + chunkTokens[k].size();
+    }
+    long long totalToken = chunkFirst[chunks];
+
+    /* Walk the counts, recording the first token and the base address
+     * of every module
+     */
+    vector<long long>& moduleFirst = walkFirst;
+    vector<int>& moduleAddress = walkAddress;
+    moduleFirst.clear();
+    moduleAddress.clear();
+    int limit[3] = {config.maxDefs, config.maxUses, INT_MAX};
+    int width[3] = {2, 1, 2};
+    ChunkCursor at = {0, 0};
+    while (at.chunk < chunks && at.index >= chunkTokens[at.chunk].size()) {
+        at.chunk++;
+    }
+    long long p = 0;
+    long long instrs = num_instr;
+    bool walked = true;
+    while (p < totalToken && walked) {
+        moduleFirst.push_back(p);
+        moduleAddress.push_back(instrs);
+        for (int k = 0; k < 3; k++) {
+            if (p >= totalToken || !isNum(chunkTokens[at.chunk][at.index])){
+                walked = false;
+                break;
+            }
+            int count = turnToInt(chunkTokens[at.chunk][at.index]);
+            long long step = 1 + (long long)count * width[k];
+            if (count > limit[k] || p + step > totalToken){
+                walked = false;
+                break;
+            }
+            if (k == 2){
+                instrs += count;
+                if (instrs > config.machineSize){
+                    walked = false;
+                    break;
+                }
+            }
+            p += step;
+            at.index += step;
+            while (at.chunk < chunks && at.index >= chunkTokens[at.chunk].size()) {
+                at.index -= chunkTokens[at.chunk].size();
+                at.chunk++;
+            }
+        }
+    }
+    if (!walked){
+        splitInput = false;
+        scanAll();
+        return parseToken();
+    }
+    int modules = moduleFirst.size();
+    moduleFirst.push_back(totalToken);
+    moduleAddress.push_back(instrs);
+
+    /* Ranges of about the same number of tokens, cut at module starts */
+    int ranges = min(chunks, max(modules, 1));
+    int* rangeModule = arena.alloc<int>(ranges + 1);
+    rangeModule[0] = 0;
+    rangeModule[ranges] = modules;
+    for (int r = 1; r < ranges; r++) {
+        long long target = totalToken * r / ranges;
+        rangeModule[r] = lower_bound(moduleFirst.begin() + rangeModule[r-1], moduleFirst.begin() + modules, target)
+                         - moduleFirst.begin();
+    }
+    while (parseWorkers.size() < ranges) {
+        parseWorkers.push_back(new Linker(-1));
+    }
+    bool* parsed = arena.allocZero<bool>(ranges);
+    vector<thread> workers;
+    for (int r = 0; r < ranges; r++) {
+        auto work = [this, r, chunks, rangeModule, &moduleFirst, &moduleAddress, chunkFirst, parsed]{
+            Linker& w = *parseWorkers[r];
+            w.reset();
+            w.out.clear();
+            w.config = config;
+            w.inputName = inputName;
+            long long first = moduleFirst[rangeModule[r]];
+            long long last = moduleFirst[rangeModule[r+1]];
+            int c = upper_bound(chunkFirst, chunkFirst + chunks + 1, first) - chunkFirst - 1;
+            for (long long g = first; g < last; g++) {
+                while (g >= chunkFirst[c+1]) {
+                    c++;
+                }
+                Token t = chunkTokens[c][g - chunkFirst[c]];
+                t.row += chunkRows[c];
+                w.token.push_back(t);
+            }
+            w.num_instr = moduleAddress[rangeModule[r]];
+            parsed[r] = w.parseToken();
+        };
+        if (r > 0){
+            workers.push_back(helper(work));
+        } else{
+            work();
+        }
+    }
+    for (int k = 0; k < workers.size(); k++) {
+        workers[k].join();
+    }
+    for (int r = 0; r < ranges; r++) {
+        droppedTokens += parseWorkers[r]->token.size();
+        if (!parsed[r]){
+            out.append(parseWorkers[r]->out);
+            return false;
+        }
+    }
+    joinParts(ranges);
+    return true;
+}
+
+/* Append the modules of the first parts workers to the program, in order:
+ * symbols are interned in order of appearance, then every part copies
+ * its arrays in place
+ */
+void Linker::joinParts(int parts){
+    ModuleIR& ir = program;
+    int** remap = arena.alloc<int*>(parts);
+    int* moduleFirst = arena.alloc<int>(parts + 1);
+    int* defFirst = arena.alloc<int>(parts + 1);
+    int* useFirst = arena.alloc<int>(parts + 1);
+    int* codeFirst = arena.alloc<int>(parts + 1);
+    moduleFirst[0] = ir.moduleCount();
+    defFirst[0] = ir.defSym.size();
+    useFirst[0] = ir.useSym.size();
+    codeFirst[0] = ir.moduleBase.back();
+    for (int r = 0; r < parts; r++) {
+        const Linker& w = *parseWorkers[r];
+        remap[r] = arena.alloc<int>(w.symbolTable.entries.size());
+        for (int id = 0; id < w.symbolTable.entries.size(); id++) {
+            remap[r][id] = symbolTable.intern(w.symbolTable.name(id), w.symbolTable.entries[id].length);
+        }
+        moduleFirst[r+1] = moduleFirst[r] + w.program.moduleCount();
+        defFirst[r+1] = defFirst[r] + w.program.defSym.size();
+        useFirst[r+1] = useFirst[r] + w.program.useSym.size();
+        codeFirst[r+1] = codeFirst[r] + w.program.word.size();
+    }
+    int modules = moduleFirst[parts];
+    int instrs = codeFirst[parts];
+    ir.defBase.resize(modules + 1);
+    ir.defSym.resize(defFirst[parts]);
+    ir.defRel.resize(defFirst[parts]);
+    ir.useBase.resize(modules + 1);
+    ir.useSym.resize(useFirst[parts]);
+    ir.moduleBase.resize(modules + 1);
+    ir.type.resize(instrs);
+    ir.digits.resize(instrs);
+    ir.opcode.resize(instrs);
+    ir.operand.resize(instrs);
+    ir.word.resize(instrs);
+    vector<thread> workers;
+    for (int r = 0; r < parts; r++) {
+        auto copy = [this, r, moduleFirst, defFirst, useFirst, codeFirst, remap]{
+            const ModuleIR& part = parseWorkers[r]->program;
+            ModuleIR& ir = program;
+            int m = moduleFirst[r];
+            int address = codeFirst[r];
+            for (int i = 0; i < part.moduleCount(); i++) {
+                ir.defBase[m + i] = defFirst[r] + part.defBase[i];
+                ir.useBase[m + i] = useFirst[r] + part.useBase[i];
+                ir.moduleBase[m + i] = address + part.moduleBase[i];
+            }
+            for (int k = 0; k < part.defSym.size(); k++) {
+                ir.defSym[defFirst[r] + k] = remap[r][part.defSym[k]];
+                ir.defRel[defFirst[r] + k] = part.defRel[k];
+            }
+            for (int k = 0; k < part.useSym.size(); k++) {
+                ir.useSym[useFirst[r] + k] = remap[r][part.useSym[k]];
+            }
+            size_t n = part.word.size();
+            if (n > 0){
+                memcpy(&ir.type[address], &part.type[0], n);
+                memcpy(&ir.digits[address], &part.digits[0], n);
+                memcpy(&ir.opcode[address], &part.opcode[0], n);
+                memcpy(&ir.operand[address], &part.operand[0], n * sizeof(int));
+                memcpy(&ir.word[address], &part.word[0], n * sizeof(int));
+            }
+        };
+        if (r > 0){
+            workers.push_back(helper(copy));
+        } else{
+            copy();
+        }
+    }
+    for (int k = 0; k < workers.size(); k++) {
+        workers[k].join();
+    }
+    ir.defBase[modules] = defFirst[parts];
+    ir.useBase[modules] = useFirst[parts];
+    ir.moduleBase[modules] = instrs;
+    num_instr = instrs;
+}
+
+/* Pass one over one file of a multi-file link, appending its modules to
+ * the program. Its tokens and mapping are dropped once it is parsed
+ */
+bool Linker::parseFile(const char* path){
+    token.clear();
+    tokenPointer = 0;
+    inputName = path;
+    bool parsed = tokenizer(path);
+    if (parsed && objectInput){
+        out.put("Object files cannot be linked with other inputs: ");
+        out.put(path);
+        out.put(".\n");
+        parsed = false;
+    }
+    parsed = parsed && parseToken();
+    inputBytes += inputSize;
+    droppedTokens += token.size();
+    token.clear();
+    releaseInput();
+    return parsed;
+}
+
+/* Pass one over the files of a multi-file link, in order as if they were
+ * one input. The files are cut into runs of about the same number of
+ * bytes, one per thread, and each run is parsed by a worker from
+ * address zero. A run is exact when it starts at address zero or it
+ * parsed and still fits the machine from its real base address; the
+ * first run that is not is parsed again here, from its first file on,
+ * so an instruction count over the machine size is reported where the
+ * serial parse would report it
+ */
+bool Linker::parseFiles(const vector<string>& paths){
+    int files = paths.size();
+    int ranges = min(parseThreads, files);
+    if (ranges <= 1){
+        for (int f = 0; f < files; f++) {
+            if (!parseFile(paths[f].c_str())){
+                return false;
+            }
+        }
+        return true;
+    }
+    long long* fileFirst = arena.allocZero<long long>(files + 1);
+    for (int f = 0; f < files; f++) {
+        struct stat st;
+        fileFirst[f+1] = fileFirst[f] + (stat(paths[f].c_str(), &st) == 0 ? st.st_size : 0);
+    }
+    int* rangeFile = arena.alloc<int>(ranges + 1);
+    rangeFile[0] = 0;
+    rangeFile[ranges] = files;
+    for (int r = 1; r < ranges; r++) {
+        long long target = fileFirst[files] * r / ranges;
+        rangeFile[r] = max(rangeFile[r-1] + 1,
+                           (int)(lower_bound(fileFirst, fileFirst + files, target) - fileFirst));
+        rangeFile[r] = min(rangeFile[r], files - (ranges - r));
+    }
+    while (parseWorkers.size() < ranges) {
+        parseWorkers.push_back(new Linker(-1));
+    }
+    bool* parsed = arena.allocZero<bool>(ranges);
+    vector<thread> workers;
+    for (int r = 0; r < ranges; r++) {
+        auto work = [this, r, &paths, rangeFile, parsed]{
+            Linker& w = *parseWorkers[r];
+            w.reset();
+            w.out.clear();
+            w.config = config;
+            bool ok = true;
+            for (int f = rangeFile[r]; f < rangeFile[r+1] && ok; f++) {
+                ok = w.parseFile(paths[f].c_str());
+            }
+            parsed[r] = ok;
+        };
+        if (r > 0){
+            workers.push_back(helper(work));
+        } else{
+            work();
+        }
+    }
+    for (int k = 0; k < workers.size(); k++) {
+        workers[k].join();
+    }
+    long long base = num_instr;
+    int exact = 0;
+    while (exact < ranges) {
+        const Linker& w = *parseWorkers[exact];
+        if (base != 0 && (!parsed[exact] || base + w.num_instr > config.machineSize)){
+            break;
+        }
+        inputBytes += w.inputBytes;
+        droppedTokens += w.droppedTokens;
+        if (!parsed[exact]){
+            out.append(w.out);
+            return false;
+        }
+        base += w.num_instr;
+        exact++;
+    }
+    joinParts(exact);
+    for (int f = exact < ranges ? rangeFile[exact] : files; f < files; f++) {
+        if (!parseFile(paths[f].c_str())){
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,171 @@
+/* File: reloc.cpp
+ * Program: two-pass linker
+ * Relocation kernels: pass two of one module
+ *
+ * Each instruction type has its own kernel, a template on the type and
+ * on the word width, and a constant table indexed by the type decoded in
+ * pass one picks the kernel. The default 4-digit machine gets kernels
+ * whose limits are constants; other widths read them from the frame. A
+ * module is relocated a block at a time: every run of instructions of
+ * one type is computed by a single kernel call, then the block is
+ * written out in order.
+ */
+#include "linker.h"
+
+/* Instructions computed before they are written out */
+static const int relocBlock = 256;
+
+static constexpr int pow10(int n){
+    return n == 0 ? 1 : 10 * pow10(n - 1);
+}
+
+/* What the kernels need to know about the module being relocated */
+struct RelocFrame{
+    const ModuleIR* ir;
+    const SymEntry* entries;
+    int* usedStamp;
+    int stamp;
+    int base;
+    int codeCount;
+    int useFirst;
+    int useCount;
+    int machineSize;
+    int wordWidth;
+    int wordLimit;
+    int opcodeScale;
+};
+
+/* Word shape of a machine, fixed at compile time for Width > 0 */
+template<int Width>
+struct WordShape{
+    static int width(const RelocFrame&){ return Width; }
+    static int limit(const RelocFrame&){ return pow10(Width); }
+    static int scale(const RelocFrame&){ return pow10(Width - 1); }
+};
+
+template<>
+struct WordShape<0>{
+    static int width(const RelocFrame& f){ return f.wordWidth; }
+    static int limit(const RelocFrame& f){ return f.wordLimit; }
+    static int scale(const RelocFrame& f){ return f.opcodeScale; }
+};
+
+/* Relocate the n instructions from j, all of type T, into word and error;
+ * an external reference also leaves its symbol in sym
+ */
+template<InstrType T, int Width>
+static void relocRun(const RelocFrame& f, int j, int n, int* word, unsigned char* error, int* sym){
+    typedef WordShape<Width> Shape;
+    const int width = Shape::width(f);
+    const int limit = Shape::limit(f);
+    const int scale = Shape::scale(f);
+    const int illegal = limit - 1;
+    const int* w = &f.ir->word[j];
+    const int* operand = &f.ir->operand[j];
+    const unsigned char* opcode = &f.ir->opcode[j];
+    const unsigned char* digits = &f.ir->digits[j];
+    for (int k = 0; k < n; k++) {
+        if (T == TYPE_I){
+            bool bad = w[k] >= limit;
+            word[k] = bad ? illegal : w[k];
+            error[k] = bad ? RELOC_IMMEDIATE : RELOC_NONE;
+        } else if (T == TYPE_A){
+            bool wide = digits[k] > width;
+            bool far = operand[k] > f.machineSize;
+            word[k] = wide ? illegal : far ? opcode[k]*scale : w[k];
+            error[k] = wide ? RELOC_OPCODE : far ? RELOC_ABSOLUTE : RELOC_NONE;
+        } else if (T == TYPE_R){
+            bool wide = digits[k] > width;
+            bool far = operand[k] > f.codeCount;
+            word[k] = wide ? illegal : far ? opcode[k]*scale + f.base : w[k] + f.base;
+            error[k] = wide ? RELOC_OPCODE : far ? RELOC_RELATIVE : RELOC_NONE;
+        } else if (operand[k] >= f.useCount){
+            word[k] = w[k];
+            error[k] = RELOC_USELIST;
+        } else{
+            int s = f.ir->useSym[f.useFirst + operand[k]];
+            const SymEntry& entry = f.entries[s];
+            f.usedStamp[s] = f.stamp;
+            sym[k] = s;
+            word[k] = opcode[k]*scale + (entry.defined ? entry.value : 0);
+            error[k] = entry.defined ? RELOC_NONE : RELOC_UNDEFINED;
+        }
+    }
+}
+
+typedef void (*RelocKernel)(const RelocFrame&, int, int, int*, unsigned char*, int*);
+
+/* Indexed by InstrType */
+static constexpr RelocKernel defaultKernels[4] = {
+    relocRun<TYPE_I, 4>, relocRun<TYPE_A, 4>, relocRun<TYPE_R, 4>, relocRun<TYPE_E, 4>
+};
+static constexpr RelocKernel anyKernels[4] = {
+    relocRun<TYPE_I, 0>, relocRun<TYPE_A, 0>, relocRun<TYPE_R, 0>, relocRun<TYPE_E, 0>
+};
+
+/* Relocate module i of ir into buf as module number of the program,
+ * loaded at base. usedStamp[id] == number + 1 marks a symbol referenced
+ * by the module. With an image the words go to image[address] and buf
+ * only gets a line for each word with an error
+ */
+void Linker::relocateModule(const ModuleIR& ir, int i, int number, int base, OutBuf& buf, int* usedStamp, int* image) const{
+    RelocFrame f;
+    f.ir = &ir;
+    f.entries = symbolTable.entries.data();
+    f.usedStamp = usedStamp;
+    f.stamp = number + 1;
+    f.base = base;
+    f.codeCount = ir.moduleBase[i+1] - ir.moduleBase[i];
+    f.useFirst = ir.useBase[i];
+    f.useCount = ir.useBase[i+1] - f.useFirst;
+    f.machineSize = config.machineSize;
+    f.wordWidth = config.wordWidth;
+    f.wordLimit = config.wordLimit();
+    f.opcodeScale = config.opcodeScale();
+    const RelocKernel* kernels = config.wordWidth == 4 ? defaultKernels : anyKernels;
+    int first = ir.moduleBase[i];
+    int last = ir.moduleBase[i+1];
+    int word[relocBlock];
+    unsigned char error[relocBlock];
+    int sym[relocBlock];
+    for (int from = first; from < last; from += relocBlock) {
+        int to = min(last, from + relocBlock);
+        for (int j = from; j < to; ) {
+            int type = ir.type[j];
+            int run = j + 1;
+            while (run < to && ir.type[run] == type) {
+                run++;
+            }
+            kernels[type](f, j, run - j, word + (j - from), error + (j - from), sym + (j - from));
+            j = run;
+        }
+        for (int k = 0; k < to - from; k++) {
+            int label = base + from + k - first;
+            if (image != NULL){
+                image[label] = word[k];
+                if (error[k] != RELOC_NONE){
+                    buf.putLabel(label);
+                    buf.putChar(':');
+                    putRelocError(buf, (RelocError)error[k], sym[k]);
+                    buf.putChar('\n');
+                }
+                continue;
+            }
+            buf.putMapLine(label, word[k]);
+            if (error[k] != RELOC_NONE){
+                putRelocError(buf, (RelocError)error[k], sym[k]);
+            }
+            buf.putChar('\n');
+        }
+    }
+    for (int m = f.useFirst; m < f.useFirst + f.useCount; m++) {
+        int s = ir.useSym[m];
+        if (usedStamp[s] != f.stamp){
+            buf.put("Warning: Module ");
+            buf.putInt(number+1);
+            buf.put(": ");
+            putSym(buf, s);
+            buf.put(" appeared in the uselist but was not actually used\n");
+        }
+    }
+}
@@ -0,0 +1,273 @@
+/* File: scan.cpp
+ * Program: two-pass linker
+ * Character classification for the tokenizer
+ *
+ * The input is classified a block at a time into bit masks of blanks,
+ * newlines and non-digits, with AVX2 (32 bytes) when compiled with
+ * -mavx2, SSE2 (16 bytes) on other x86-64 builds and a plain loop
+ * elsewhere. Token boundaries are the edges of the "not a separator"
+ * mask, and a token is a number when no non-digit bit falls inside it.
+ */
+#include "linker.h"
+#include <thread>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+static const int blockSize = 32;
+#elif defined(__SSE2__)
+static const int blockSize = 16;
+#else
+static const int blockSize = 8;
+#endif
+
+/* Bytes the producer tokenizes per batch, a multiple of every block size */
+static const int pipeChunk = 1 << 16;
+
+/* Bit k of each mask describes byte k of the block */
+struct BlockMasks{
+    unsigned blank;
+    unsigned newline;
+    unsigned nondigit;
+};
+
+static inline BlockMasks classify(const char* p){
+    BlockMasks m;
+#if defined(__AVX2__)
+    __m256i c = _mm256_loadu_si256((const __m256i*)p);
+    __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                    _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t')));
+    /* '0'..'9' shifted to -128..-119, the bottom of the signed range */
+    __m256i shifted = _mm256_sub_epi8(c, _mm256_set1_epi8('0' - 128));
+    __m256i nondigit = _mm256_cmpgt_epi8(shifted, _mm256_set1_epi8(-128 + 9));
+    m.blank = _mm256_movemask_epi8(blank);
+    m.newline = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')));
+    m.nondigit = _mm256_movemask_epi8(nondigit);
+#elif defined(__SSE2__)
+    __m128i c = _mm_loadu_si128((const __m128i*)p);
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(c, _mm_set1_epi8('\t')));
+    __m128i shifted = _mm_sub_epi8(c, _mm_set1_epi8('0' - 128));
+    __m128i nondigit = _mm_cmpgt_epi8(shifted, _mm_set1_epi8(-128 + 9));
+    m.blank = _mm_movemask_epi8(blank);
+    m.newline = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')));
+    m.nondigit = _mm_movemask_epi8(nondigit);
+#else
+    m.blank = 0;
+    m.newline = 0;
+    m.nondigit = 0;
+    for (int k = 0; k < blockSize; k++) {
+        unsigned char ch = p[k];
+        m.blank |= (unsigned)(ch == ' ' || ch == '\t') << k;
+        m.newline |= (unsigned)(ch == '\n') << k;
+        m.nondigit |= (unsigned)(ch - '0' > 9u) << k;
+    }
+#endif
+    return m;
+}
+
+/* Bits [lo, hi) of a block mask */
+static inline unsigned bitRange(int lo, int hi){
+    unsigned upper = hi >= 32 ? ~0u : (1u << hi) - 1;
+    return upper & ~((1u << lo) - 1);
+}
+
+/* True if all n bytes at s are decimal digits */
+bool allDigits(const char* s, int n){
+    int k = 0;
+    if (n >= blockSize){
+        for (; k + blockSize <= n; k += blockSize) {
+            if (classify(s + k).nondigit != 0){
+                return false;
+            }
+        }
+        return classify(s + n - blockSize).nondigit == 0;
+    }
+    for (; k < n; k++) {
+        if ((unsigned char)s[k] - '0' > 9u){
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Block tokenizer over the input, resumable at any block boundary so
+ * the input can be handed over in chunks
+ */
+struct BlockScanner{
+    const char* line;
+    int row;
+    bool inToken;
+    bool numeric;
+    int startBit;
+    unsigned carry;
+    Token t;
+
+    BlockScanner(const char* start): line(start), row(1), inToken(false), numeric(false), startBit(0), carry(0) {}
+    void scan(const char* p, const char* end, const char* inputEnd, vector<Token>& out);
+};
+
+/* Scan [p, end), where end is a block boundary or the end of the input */
+void BlockScanner::scan(const char* p, const char* end, const char* inputEnd, vector<Token>& out){
+    char tail[blockSize];
+    for (; p < end; p += blockSize) {
+        const char* block = p;
+        unsigned valid = ~0u;
+        if (end - p < blockSize){
+            /* The last partial block is padded with blanks */
+            memset(tail, ' ', blockSize);
+            memcpy(tail, p, end - p);
+            block = tail;
+            valid = bitRange(0, end - p);
+        }
+        BlockMasks m = classify(block);
+        unsigned inside = ~(m.blank | m.newline) & valid & bitRange(0, blockSize);
+        unsigned before = (inside << 1) | carry;
+        unsigned starts = inside & ~before;
+        unsigned ends = ~inside & before & bitRange(0, blockSize);
+        unsigned events = starts | ends | (m.newline & valid);
+        while (events != 0) {
+            int b = __builtin_ctz(events);
+            events &= events - 1;
+            if (starts >> b & 1){
+                t.text = p + b;
+                t.row = row;
+                t.col = p + b - line + 1;
+                numeric = true;
+                startBit = b;
+                inToken = true;
+            } else if (ends >> b & 1){
+                numeric = numeric && (m.nondigit & bitRange(startBit, b)) == 0;
+                t.length = p + b - t.text;
+                t.numeric = numeric;
+                out.push_back(t);
+                inToken = false;
+            }
+            if (m.newline >> b & 1){
+                row++;
+                line = p + b + 1;
+            }
+        }
+        if (inToken){
+            numeric = numeric && (m.nondigit & bitRange(startBit, blockSize)) == 0;
+            startBit = 0;
+        }
+        carry = inside >> (blockSize - 1) & 1;
+    }
+    if (end == inputEnd && inToken){
+        t.length = end - t.text;
+        t.numeric = numeric;
+        out.push_back(t);
+        inToken = false;
+    }
+}
+
+/* Tokenize the whole input in blocks, the result is the same as calling
+ * scanToken until the end of the input
+ */
+void Linker::scanAll(){
+    const char* end = inputData + inputSize;
+    BlockScanner scanner(inputData);
+    scanner.scan(inputData, end, end, token);
+    scanEnd(scanner.line, scanner.row);
+}
+
+/* Tokenize [from, to) on its own, rows counted from 1 at from; to is
+ * the start of a line or the end of the input. Return the number of
+ * newlines in the range
+ */
+int scanChunk(const char* from, const char* to, vector<Token>& out){
+    BlockScanner scanner(from);
+    scanner.scan(from, to, to, out);
+    return scanner.row - 1;
+}
+
+/* Leave the cursor at the end of the last line, which sets the final
+ * position the way scanToken would. line and row are those of the line
+ * after the last newline
+ */
+void Linker::scanEnd(const char* line, int row){
+    const char* end = inputData + inputSize;
+    if (inputSize > 0){
+        if (end[-1] == '\n'){
+            row--;
+            line = (const char*)memrchr(inputData, '\n', end - 1 - inputData);
+            line = line == NULL ? inputData : line + 1;
+        }
+        startLine(line, row);
+        scanPos = scanTrimEnd;
+    }
+    scanToken();
+}
+
+/* Pipelined pass one, run on its own thread: tokenize the input a chunk
+ * at a time into the slots of the pipe, until the input ends or the
+ * parser stops the pipe
+ */
+void Linker::produceTokens(){
+    const char* end = inputData + inputSize;
+    BlockScanner scanner(inputData);
+    const char* p = inputData;
+    while (p < end) {
+        const char* chunkEnd = end - p > pipeChunk ? p + pipeChunk : end;
+        vector<Token>* batch = pipe->reserve();
+        if (batch == NULL){
+            pipe->close();
+            return;
+        }
+        batch->clear();
+        scanner.scan(p, chunkEnd, end, *batch);
+        pipe->publish();
+        p = chunkEnd;
+    }
+    scanEnd(scanner.line, scanner.row);
+    pipe->close();
+}
+
+TokenPipe::TokenPipe(): head(0), tail(0), done(false), stopped(false){
+}
+
+/* Producer: wait for a free slot, NULL once the consumer has stopped */
+vector<Token>* TokenPipe::reserve(){
+    unsigned t = tail.load(memory_order_relaxed);
+    while (t - head.load(memory_order_acquire) == pipeSlots) {
+        if (stopped.load(memory_order_relaxed)){
+            return NULL;
+        }
+        this_thread::yield();
+    }
+    if (stopped.load(memory_order_relaxed)){
+        return NULL;
+    }
+    return &slot[t % pipeSlots];
+}
+
+void TokenPipe::publish(){
+    tail.store(tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void TokenPipe::close(){
+    done.store(true, memory_order_release);
+}
+
+/* Consumer: append the next batch to tokens, false once the producer
+ * is done and every batch is taken
+ */
+bool TokenPipe::pop(vector<Token>& tokens){
+    unsigned h = head.load(memory_order_relaxed);
+    while (h == tail.load(memory_order_acquire)) {
+        if (done.load(memory_order_acquire) && h == tail.load(memory_order_acquire)){
+            return false;
+        }
+        this_thread::yield();
+    }
+    vector<Token>& batch = slot[h % pipeSlots];
+    tokens.insert(tokens.end(), batch.begin(), batch.end());
+    head.store(h + 1, memory_order_release);
+    return true;
+}
+
+void TokenPipe::stop(){
+    stopped.store(true, memory_order_relaxed);
+}
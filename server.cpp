@@ -0,0 +1,181 @@
+/* File: server.cpp
+ * Program: two-pass linker
+ * Server mode: link requests over a Unix domain socket or stdin/stdout
+ *
+ * Every request and response is a frame: a 32-bit payload length, a
+ * 32-bit request id and the payload, integers in host byte order. The
+ * payload of a request is the path of the input, that of the response
+ * is exactly what './linker <input>' prints, under the request's id.
+ * A pool of threads serves the requests, each thread keeping one Linker
+ * whose buffers are reused from request to request.
+ */
+#include "linker.h"
+#include <thread>
+#include <mutex>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Largest request payload accepted, a path */
+static const unsigned maxRequest = 1 << 16;
+
+/* One stream of frames. Several threads may share a channel, the locks
+ * keep their frames from interleaving
+ */
+struct Channel{
+    int inFd;
+    int outFd;
+    mutex readLock;
+    mutex writeLock;
+
+    Channel(int in, int out): inFd(in), outFd(out) {}
+};
+
+static bool readFull(int fd, char* s, size_t n){
+    while (n > 0) {
+        ssize_t count = read(fd, s, n);
+        if (count < 0 && errno == EINTR){
+            continue;
+        }
+        if (count <= 0){
+            return false;
+        }
+        s += count;
+        n -= count;
+    }
+    return true;
+}
+
+static bool writeFull(int fd, const char* s, size_t n){
+    while (n > 0) {
+        ssize_t count = write(fd, s, n);
+        if (count < 0 && errno == EINTR){
+            continue;
+        }
+        if (count <= 0){
+            return false;
+        }
+        s += count;
+        n -= count;
+    }
+    return true;
+}
+
+/* Read one request, false at the end of the stream or on a bad frame */
+static bool readRequest(Channel& channel, unsigned& id, string& path){
+    lock_guard<mutex> guard(channel.readLock);
+    unsigned header[2];
+    if (!readFull(channel.inFd, (char*)header, sizeof(header)) || header[0] > maxRequest){
+        return false;
+    }
+    id = header[1];
+    path.resize(header[0]);
+    return header[0] == 0 || readFull(channel.inFd, &path[0], header[0]);
+}
+
+static bool writeResponse(Channel& channel, unsigned id, const OutBuf& out){
+    lock_guard<mutex> guard(channel.writeLock);
+    unsigned header[2] = {(unsigned)out.used, id};
+    return writeFull(channel.outFd, (const char*)header, sizeof(header))
+           && writeFull(channel.outFd, out.data, out.used);
+}
+
+/* Answer requests from a channel until it ends */
+static void serveChannel(Channel& channel, Linker& linker, const LinkSettings& settings){
+    LinkStats linkStats;
+    linker.stats = settings.stats ? &linkStats : NULL;
+    unsigned id;
+    string path;
+    while (readRequest(channel, id, path)) {
+        linker.reset();
+        linker.out.clear();
+        linker.link(path.c_str());
+        if (settings.stats){
+            linkStats.bytesWritten = linker.out.used;
+            settings.emitStats(linkStats);
+        }
+        if (!writeResponse(channel, id, linker.out)){
+            return;
+        }
+    }
+}
+
+static void socketWorker(int listenFd, const LinkSettings* settings){
+    Linker linker(-1);
+    settings->apply(linker);
+    while (true) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            return;
+        }
+        Channel channel(fd, fd);
+        serveChannel(channel, linker, *settings);
+        close(fd);
+    }
+}
+
+static void streamWorker(Channel* channel, const LinkSettings* settings){
+    Linker linker(-1);
+    settings->apply(linker);
+    serveChannel(*channel, linker, *settings);
+}
+
+/* Serve requests on a Unix domain socket at path, or on stdin and stdout
+ * when path is "-". A socket connection is served by one thread at a
+ * time, so clients wanting concurrency open several connections; on
+ * stdin every thread takes requests as they come and the responses may
+ * be out of order. Return once stdin ends, a socket server runs until
+ * it is killed
+ */
+int runServer(const char* path, int threads, const LinkSettings& settings){
+    signal(SIGPIPE, SIG_IGN);
+    if (threads < 1){
+        threads = 1;
+    }
+    vector<thread> pool;
+    if (strcmp(path, "-") == 0){
+        Channel channel(STDIN_FILENO, STDOUT_FILENO);
+        for (int i = 1; i < threads; i++) {
+            pool.push_back(thread(streamWorker, &channel, &settings));
+        }
+        streamWorker(&channel, &settings);
+        for (int i = 0; i < pool.size(); i++) {
+            pool[i].join();
+        }
+        return 0;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "linker: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0){
+        if (!S_ISSOCK(st.st_mode)){
+            fprintf(stderr, "linker: %s exists and is not a socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listenFd, 128) != 0){
+        fprintf(stderr, "linker: cannot listen on %s\n", path);
+        return 1;
+    }
+    for (int i = 1; i < threads; i++) {
+        pool.push_back(thread(socketWorker, listenFd, &settings));
+    }
+    socketWorker(listenFd, &settings);
+    for (int i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+    close(listenFd);
+    return 1;
+}
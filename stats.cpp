@@ -0,0 +1,125 @@
+/* File: stats.cpp
+ * Program: two-pass linker
+ * Per-phase timing, size and heap allocation figures for --stats
+ */
+#include "linker.h"
+#include <new>
+#include <cstdlib>
+#include <ctime>
+#include <sys/resource.h>
+
+thread_local unsigned long long heapAllocs = 0;
+
+/* Count every allocation, the cost is one thread-local increment */
+void* operator new(size_t size){
+    heapAllocs++;
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL){
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+double LinkStats::now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char* LinkStats::phaseName(int phase){
+    static const char* names[PHASE_COUNT] = {
+        "tokenizer", "parseToken", "symTooBig", "getSymbolTable",
+        "getMemoryMap", "printSymNotInUse"
+    };
+    return names[phase];
+}
+
+void LinkStats::begin(const char* path, unsigned long long writtenBefore){
+    input = path;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        seconds[i] = 0;
+        allocs[i] = 0;
+    }
+    tokens = 0;
+    modules = 0;
+    symbols = 0;
+    instructions = 0;
+    removedModules = 0;
+    removedWords = 0;
+    bytesRead = 0;
+    bytesWritten = writtenBefore;
+    peakRssKb = 0;
+    lapStart = now();
+    lapAllocs = heapAllocs;
+}
+
+/* Charge the time and allocations since the last lap to a phase */
+void LinkStats::lap(Phase phase){
+    double t = now();
+    seconds[phase] += t - lapStart;
+    allocs[phase] += heapAllocs - lapAllocs;
+    lapStart = t;
+    lapAllocs = heapAllocs;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0){
+        peakRssKb = usage.ru_maxrss;
+    }
+}
+
+void LinkStats::report(FILE* file) const{
+    double total = 0;
+    fprintf(file, "linker stats: %s\n", input.c_str());
+    fprintf(file, "  %-18s %12s %12s\n", "phase", "seconds", "allocs");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(file, "  %-18s %12.6f %12llu\n", phaseName(i), seconds[i], allocs[i]);
+        total += seconds[i];
+    }
+    fprintf(file, "  %-18s %12.6f\n", "total", total);
+    fprintf(file, "  tokens %lld  modules %lld  symbols %lld  instructions %lld\n",
+            tokens, modules, symbols, instructions);
+    fprintf(file, "  removed by --gc-sections: modules %lld  words %lld\n", removedModules, removedWords);
+    fprintf(file, "  bytes read %lld  bytes written %lld  peak rss %ld KB\n",
+            bytesRead, bytesWritten, peakRssKb);
+}
+
+/* One JSON object on a single line, so runs can be appended to a file */
+string LinkStats::json() const{
+    string text = "{\"input\":\"";
+    for (int i = 0; i < input.size(); i++) {
+        unsigned char c = input[i];
+        if (c == '"' || c == '\\'){
+            text += '\\';
+            text += c;
+        } else if (c < 0x20){
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            text += escaped;
+        } else{
+            text += c;
+        }
+    }
+    text += "\",\"phases\":{";
+    char field[160];
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        snprintf(field, sizeof(field), "%s\"%s\":{\"seconds\":%.9f,\"allocs\":%llu}",
+                 i == 0 ? "" : ",", phaseName(i), seconds[i], allocs[i]);
+        text += field;
+    }
+    snprintf(field, sizeof(field), "},\"tokens\":%lld,\"modules\":%lld,\"symbols\":%lld,\"instructions\":%lld,",
+             tokens, modules, symbols, instructions);
+    text += field;
+    snprintf(field, sizeof(field), "\"removedModules\":%lld,\"removedWords\":%lld,", removedModules, removedWords);
+    text += field;
+    snprintf(field, sizeof(field), "\"bytesRead\":%lld,\"bytesWritten\":%lld,\"peakRssKb\":%ld}\n",
+             bytesRead, bytesWritten, peakRssKb);
+    text += field;
+    return text;
+}
@@ -0,0 +1,98 @@
+/* File: xref.cpp
+ * Program: two-pass linker
+ * Cross-reference index: for every symbol the modules that define it
+ * and the modules that name it in their uselist
+ */
+#include "linker.h"
+
+void XrefIndex::clear(){
+    referenced.clear();
+    defBase.clear();
+    defModule.clear();
+    refBase.clear();
+    refModule.clear();
+}
+
+/* Group the pairs (sym[k], module owning k) by symbol with a counting
+ * sort; modules come out in increasing order for every symbol, each
+ * once even when it names the symbol several times
+ */
+static void groupBySymbol(const vector<int>& moduleBase, const vector<int>& sym, int symbols,
+                          vector<int>& base, vector<int>& module){
+    base.assign(symbols + 1, 0);
+    vector<int> last(symbols, -1);
+    for (int i = 0; i + 1 < moduleBase.size(); i++) {
+        for (int k = moduleBase[i]; k < moduleBase[i+1]; k++) {
+            if (last[sym[k]] != i){
+                last[sym[k]] = i;
+                base[sym[k] + 1]++;
+            }
+        }
+    }
+    for (int s = 0; s < symbols; s++) {
+        base[s+1] += base[s];
+    }
+    vector<int> fill(base.begin(), base.end() - 1);
+    module.resize(base[symbols]);
+    for (int i = 0; i + 1 < moduleBase.size(); i++) {
+        for (int k = moduleBase[i]; k < moduleBase[i+1]; k++) {
+            int s = sym[k];
+            if (fill[s] == base[s] || module[fill[s] - 1] != i){
+                module[fill[s]++] = i;
+            }
+        }
+    }
+}
+
+/* Mark every symbol of a uselist as referenced, and with lists also
+ * record which modules define and reference each symbol
+ * Symbols marked before, by the streaming pass one, stay marked
+ */
+void XrefIndex::build(const ModuleIR& ir, int symbols, bool lists){
+    referenced.resize(symbols, false);
+    for (int k = 0; k < ir.useSym.size(); k++) {
+        referenced[ir.useSym[k]] = true;
+    }
+    if (lists){
+        groupBySymbol(ir.defBase, ir.defSym, symbols, defBase, defModule);
+        groupBySymbol(ir.useBase, ir.useSym, symbols, refBase, refModule);
+    }
+}
+
+static void putModules(OutBuf& buf, const vector<int>& base, const vector<int>& module, int sym){
+    for (int k = base[sym]; k < base[sym+1]; k++) {
+        buf.putChar(' ');
+        buf.putInt(module[k] + 1);
+    }
+}
+
+/* Format the --xref report, one line per symbol in order of appearance:
+ *   <symbol> defined in <modules> referenced by <modules>
+ * with "not defined" or "referenced by none" where a list is empty
+ */
+void Linker::putXref(OutBuf& buf){
+    xref.build(program, symbolTable.entries.size(), true);
+    for (int sym = 0; sym < symbolTable.entries.size(); sym++) {
+        putSym(buf, sym);
+        if (xref.defBase[sym] == xref.defBase[sym+1]){
+            buf.put(" not defined");
+        } else{
+            buf.put(" defined in");
+            putModules(buf, xref.defBase, xref.defModule, sym);
+        }
+        if (xref.refBase[sym] == xref.refBase[sym+1]){
+            buf.put(" referenced by none\n");
+        } else{
+            buf.put(" referenced by");
+            putModules(buf, xref.refBase, xref.refModule, sym);
+            buf.putChar('\n');
+        }
+    }
+}
+
+/* Write the --xref report to path, false if it cannot be written */
+bool Linker::writeXref(const char* path){
+    OutBuf buf(-1);
+    putXref(buf);
+    return writeFile(path, string(buf.data, buf.used));
+}